@@ -1,8 +1,11 @@
 // Minimal shared_ptr implementation.
+// Built on sp::shared_ptr: one control block holds both counts and the deleter, make_shared
+// places the object in it (a single allocation) and a shared_ptr is two words wide.
+#pragma once
 
 #include <cstdlib>  // nullptr_t
-#include <atomic>   // atomic
-#include <utility>  // swap
+#include <utility>  // swap, forward
+#include "smart_ptr.h" // sp::shared_ptr, sp::make_shared
 
     template <class T>
     T& move(T&& t) noexcept { return static_cast<T&&>(t); }
@@ -15,23 +18,8 @@
     #define FORWARD(...) static_cast<decltype(__VA_ARGS__)&&>(__VA_ARGS__)
 
     template<typename T>
-    class shared_ptr {
-        // Type erasure for run-time polymorphic behavior of deleter.
-        class deleter_base {
-            public:
-            virtual ~deleter_base() = default;
-            virtual void operator()(void*) = 0;
-        };
-
-        template <typename T>
-        class deleter : public deleter_base {
-            public:
-            void operator()(void* p) override { delete static_cast<T*>(p); }
-        };
-
-        T* _ptr{ nullptr };            // contained pointer
-        std::atomic<long>* _ref_count; // reference counter
-        deleter_base* _deleter;        // deleter
+    class shared_ptr : public sp::shared_ptr<T> {
+        using base = sp::shared_ptr<T>;
 
       public:
         // Default ctor, constructs an empty shared_ptr.
@@ -39,126 +27,46 @@
         // Construct empty shared_ptr.
         constexpr shared_ptr(std::nullptr_t) noexcept { }
         // Ctor wraps raw pointer.
-        shared_ptr(T* p) : _ptr{ p }, _ref_count{ new std::atomic<long>{1} }, _deleter{ new deleter<T>() } { }
-        // Ctor wraps raw pointer of convertible type.
+        shared_ptr(T* p) : base{ p } { }
+        // Ctor wraps raw pointer of convertible type, deleted as U.
         template<typename U>
-        shared_ptr(U* p) : _ptr{ p }, _ref_count{ new std::atomic<long>{1} }, _deleter{ new deleter<U>() } { }
+        shared_ptr(U* p) : base{ p } { }
         // Copy ctor.
-        shared_ptr(const shared_ptr& sp) noexcept : _ptr{ sp._ptr }, _ref_count{ sp._ref_count }, _deleter{ sp._deleter } { 
-            if (_ptr)
-                ++(*_ref_count);
-        }
+        shared_ptr(const shared_ptr& sp) noexcept = default;
         // Conversion ctor.
         template<typename U>
-        shared_ptr(const shared_ptr<U>& sp) noexcept : _ptr{sp._ptr}, _ref_count{sp._ref_count}, _deleter{sp._deleter} {
-            if (_ptr)
-                ++(*_ref_count);
-        }
+        shared_ptr(const shared_ptr<U>& sp) noexcept : base{ sp } { }
         // Move ctor, move-construct shared_ptr from sp.
-        shared_ptr(shared_ptr&& sp) noexcept : _ptr{ std::move(sp._ptr) }, _ref_count{ std::move(sp._ref_count) }, _deleter{ std::move(sp._deleter) } {
-            sp._ptr = nullptr;
-            sp._ref_count = nullptr;
-            sp._deleter = nullptr;
-        }
+        shared_ptr(shared_ptr&& sp) noexcept = default;
         template<typename U>
-        shared_ptr(shared_ptr<U>&& sp) noexcept : _ptr{ sp._ptr }, _ref_count{ sp._ref_count }, _deleter{ sp._deleter } {
-            sp._ptr = nullptr;
-            sp._ref_count = nullptr;
-            sp._deleter = nullptr;
-        }
-
-        // No effect if shared_ptr is empty or use_count() > 1, otherwise release the resources.
-        ~shared_ptr() {
-            if (_ptr)
-            {
-                if (--(*_ref_count) == 0)
-                {
-                    delete _ref_count;
-                    (*_deleter)(_ptr);
-                    delete _deleter;
-                }
-            }
-        }
+        shared_ptr(shared_ptr<U>&& sp) noexcept : base{ std::move(static_cast<sp::shared_ptr<U>&>(sp)) } { }
+        // Share ownership with an sp::shared_ptr, e.g. the result of sp::make_shared.
+        template<typename U>
+        shared_ptr(const sp::shared_ptr<U>& sp) noexcept : base{ sp } { }
+        template<typename U>
+        shared_ptr(sp::shared_ptr<U>&& sp) noexcept : base{ std::move(sp) } { }
 
         // Copy assignment.
-        shared_ptr& operator= (const shared_ptr& sp) noexcept {
-            // Copy and swap idiom.
-            shared_ptr tmp{sp};
-            tmp.swap(*this);
-            return *this;
-        }
+        shared_ptr& operator=(const shared_ptr& sp) noexcept = default;
         // Move assignment.
-        shared_ptr& operator=(shared_ptr&& sp) noexcept {
-            shared_ptr{ std::move(sp) }.swap(*this);
-            return *this;
-        }
+        shared_ptr& operator=(shared_ptr&& sp) noexcept = default;
         template<typename U>
         shared_ptr& operator=(shared_ptr<U>&& sp) noexcept {
             shared_ptr{ std::move(sp) }.swap(*this);
             return *this;
         }
 
-        // Dereference pointer to managed object.
-        T& operator*() const noexcept { return *_ptr; }
-        T* operator->() const noexcept { return _ptr; }
-
-        // Return the contained pointer.
-        T* get() const noexcept { return _ptr; }
-
-        // Return use count (use count == 0 if shared_ptr is empty).
-        long use_count() const noexcept {
-            if (_ptr)
-                return *_ref_count;
-            else
-                return 0;
-        }
-
-        // Check if solely owns managed object.
-        bool unique() const noexcept { return (use_count() == 1) ? true : false; }
-
-        // Check if there is an associated managed object.
-        explicit operator bool() const noexcept { return (_ptr) ? true : false; }
-
-        // Resets shared_ptr to empty.
-        void reset() noexcept {
-            shared_ptr tmp{};
-            tmp.swap(*this);
-        }
         // Reset shared_ptr to wrap raw pointer p.
-        template<typename U>
-        void reset(U* p) {
-            shared_ptr tmp{p};
-            tmp.swap(*this);
-        }
+        using base::reset;
 
         // Swap with another shared_ptr.
-        void swap(shared_ptr& sp) noexcept {
-            using std::swap;
-            swap(_ptr, sp._ptr);
-            swap(_ref_count, sp._ref_count);
-            swap(_deleter, sp._deleter);
-        }
-    };
-
-    // Operator overloading.
-    template<typename T, typename U>
-    inline bool operator==(const shared_ptr<T>& sp1, const shared_ptr<U>& sp2) { return sp1.get() == sp2.get(); }
+        void swap(shared_ptr& sp) noexcept { base::swap(sp); }
 
-    template<typename T>
-    inline bool operator==(const shared_ptr<T>& sp, std::nullptr_t) noexcept { return !sp; }
-
-    template<typename T>
-    inline bool operator==(std::nullptr_t, const shared_ptr<T>& sp) noexcept { return !sp; }
-
-    template<typename T, typename U>
-    inline bool operator!=(const shared_ptr<T>& sp1, const shared_ptr<U>& sp2) { return sp1.get() != sp2.get(); }
-
-    template<typename T>
-    inline bool operator!=(const shared_ptr<T>& sp, std::nullptr_t) noexcept { return bool{sp}; }
-
-    template<typename T>
-    inline bool operator!=(std::nullptr_t, const shared_ptr<T>& sp) noexcept { return bool{sp}; }
+        // Dereference, get, use_count, unique, operator bool and the comparisons with
+        // shared_ptr and nullptr come from sp::shared_ptr.
+    };
 
     // Create shared_ptr that manages a new object.
+    // The object is constructed inside its control block, a single allocation.
     template<typename T, typename... Args>
-    inline shared_ptr<T> make_shared(Args&&... args) { return shared_ptr<T>{new T{ std::forward<Args>(args)... }}; }
+    inline shared_ptr<T> make_shared(Args&&... args) { return shared_ptr<T>{ sp::make_shared<T>(std::forward<Args>(args)...) }; }
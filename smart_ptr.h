@@ -1,15 +1,58 @@
 // wek_ptr, shared_ptr and unique_ptr.
+#pragma once
+
 #include <memory>       // allocator, addressof
+#include <memory_resource> // pmr::memory_resource, pmr::polymorphic_allocator
 #include <atomic>       // atomic
-#include <exception>    // exception
+#include <exception>    // exception, terminate
 #include <type_traits>  // remove_extent, extent, remove_extent, is_array, is_void
                         // conditional, is_reference, common_type
 #include <cstddef>      // nullptr_t, size_t, ptrdiff_t
+#include <cstdint>      // uint64_t, uintptr_t
+#include <new>          // align_val_t, bad_alloc, bad_array_new_length
 #include <utility>      // move, forward, swap
 #include <functional>   // less, hash
 #include <iostream>     // basic_ostream, common_type
 #include <tuple>        // tuple, get(tuple)
 #include <cassert>      // assert
+#include <typeinfo>     // typeid
+#include <vector>       // vector
+#include <thread>       // thread
+#include <mutex>        // mutex, unique_lock
+#include <condition_variable> // condition_variable
+#include <algorithm>    // sort, partition, binary_search
+#include <iterator>     // iterator_traits
+#include <cstring>      // memcpy
+
+// Build options.
+// SP_POOL_CONTROL_BLOCKS: recycle the control blocks of shared_ptr built from raw pointers,
+//     see use_control_block_pool. Default 0.
+#ifndef SP_POOL_CONTROL_BLOCKS
+#define SP_POOL_CONTROL_BLOCKS 0
+#endif
+// SP_REFCOUNT_STATS: count reference operations per managed type, see refcount_stats.
+//     Default 0, in which case no counting code or storage is compiled in.
+#ifndef SP_REFCOUNT_STATS
+#define SP_REFCOUNT_STATS 0
+#endif
+// SP_CACHE_LINE_SIZE: padding used to keep reference counters and objects on separate cache
+//     lines, see make_shared_padded. Default 64, std::hardware_destructive_interference_size
+//     is not used as it changes with -mtune and would change the layout between builds.
+#ifndef SP_CACHE_LINE_SIZE
+#define SP_CACHE_LINE_SIZE 64
+#endif
+
+// Compiler support.
+// SP_TRIVIALLY_RELOCATABLE: marks a class trivially relocatable on compilers implementing
+//     P1144 [[trivially_relocatable]], empty elsewhere, see is_trivially_relocatable.
+#if defined(__has_cpp_attribute)
+#if __has_cpp_attribute(trivially_relocatable)
+#define SP_TRIVIALLY_RELOCATABLE [[trivially_relocatable]]
+#endif
+#endif
+#ifndef SP_TRIVIALLY_RELOCATABLE
+#define SP_TRIVIALLY_RELOCATABLE
+#endif
 
 namespace sp {
     // Ptr class that wraps the deleter, use tuple for Empty Base Optimization
@@ -31,72 +74,6 @@ namespace sp {
         std::tuple<T*, D> _impl_t;
     };
 
-    // Control block interface, type erasure for storing deleter and allocators.
-    class control_block_base {
-    public:
-        virtual ~control_block_base() { };
-
-        virtual void inc_ref() noexcept = 0;
-        virtual void inc_wref() noexcept = 0;
-        virtual void dec_ref() noexcept = 0;
-        virtual void dec_wref() noexcept = 0;
-
-        virtual long use_count() const noexcept = 0;
-        virtual bool unique() const noexcept = 0;
-        virtual long weak_use_count() const noexcept = 0;
-        virtual bool expired() const noexcept = 0;
-
-        virtual void* get_deleter() noexcept = 0;
-    };
-
-    // Control block for reference counting of shared_ptr and weak_ptr.
-    // No custom allocator support. The allocator is intended to be used 
-    // to allocate/deallocate internal shared_ptr details, not the object.
-    template<typename T, typename D = default_delete<T>>
-    class control_block : public control_block_base {
-    public:
-        control_block(T* p) : _impl{ p } { }
-        control_block(T* p, D d) : _impl{ p, d } { }
-        ~control_block() { }
-
-        void inc_ref() noexcept override { ++_use_count; }
-        void inc_wref() noexcept override { ++_weak_use_count; }
-
-        void dec_ref() noexcept override {
-            auto _ptr = _impl._impl_ptr();
-            auto& _deleter = _impl._impl_deleter();
-            if (--_use_count == 0) {
-                if (_ptr)
-                    _deleter(_ptr); // destroy the object _ptr points to
-                dec_wref();
-            }
-        }
-
-        void dec_wref() noexcept override {
-            if (--_weak_use_count == 0)
-                delete this; // destroy control_block itself
-        }
-
-        // Return #shared_ptr
-        long use_count() const noexcept override { return _use_count; }
-
-        bool unique() const noexcept override { return _use_count == 1; }
-
-        // Return #weak_ptr
-        long weak_use_count() const noexcept override { return _weak_use_count - ((_use_count > 0) ? 1 : 0); }
-
-        bool expired() const noexcept override { return _use_count == 0; }
-
-        // Type erasure for storing deleter
-        void* get_deleter() noexcept override { return reinterpret_cast<void*>(std::addressof(_impl._impl_deleter())); }
-
-    private:
-        std::atomic<long> _use_count{ 1 };
-        // Note: _weak_use_count = #weak_ptrs + (#shared_ptr > 0) ? 1 : 0
-        std::atomic<long> _weak_use_count{ 1 };
-        Ptr<T, D> _impl;
-    };
-
     // Default destruction policy used by unique_ptr & shared_ptr when no deleter is specified.
     template <typename T>
     class default_delete {
@@ -124,567 +101,2532 @@ namespace sp {
         void operator()(T* p) const { delete[] p; }
     };
 
-    // Type exception thrown by ctors of shared_ptr with weak_ptr as argument, when weak_ptr refers to already deleted object.
-    class bad_weak_ptr : public std::exception {
-    public:
-        const char* what() noexcept { return "weak_ptr is expired!"; }
-    };
-
-    // Forward declaration
-    template<typename T> class shared_ptr;
+    // Destruction policy for arrays from make_unique_for_overwrite(n, align): the elements were
+    // constructed in place into over-aligned storage, so the deleter carries the length and alignment.
+    template <typename T>
+    class aligned_delete;
 
-    // weak_ptr implementation
     template <typename T>
-    class weak_ptr {
+    class aligned_delete<T[]> {
     public:
-        template<typename U> friend class shared_ptr;
-        template<typename U> friend class weak_ptr;
+        // Default ctor.
+        constexpr aligned_delete() noexcept = default;
+        // Construct for n elements in storage aligned to al.
+        constexpr aligned_delete(std::size_t n, std::align_val_t al) noexcept : _size{ n }, _align{ al } { }
 
-        using element_type = typename std::remove_extent<T>::type;
+        // Call operator: destroy the elements in reverse order and release the storage.
+        void operator()(T* p) const {
+            if (!p)
+                return;
+            for (std::size_t i = _size; i > 0; --i)
+                p[i - 1].~T();
+            ::operator delete[](static_cast<void*>(p), _align);
+        }
 
-        // Default ctor, creates an empty weak_ptr.
-        // Postconditions: use_count() == 0.
-        constexpr weak_ptr() noexcept : _ptr{}, _control_block{} { }
-        // Conversion ctor: shares ownership with sp.
-        // Postconditions: use_count() == sp.use_count().
-        template<class U>
-        weak_ptr(shared_ptr<U> const& sp) noexcept : _ptr{ sp._ptr }, _control_block{ sp._control_block }
-        { if (_control_block) _control_block->inc_wref(); }
-        // Copy ctor: shares ownership with wp.
-        // Postconditions: use_count() == wp.use_count().
-        weak_ptr(weak_ptr const& wp) noexcept : _ptr{ wp._ptr }, _control_block{ wp._control_block }
-        { if (_control_block) _control_block->inc_wref(); }
-        // Copy ctor: shares ownership with wp.
-        // Postconditions: use_count() == wp.use_count().
-        template<class U>
-        weak_ptr(weak_ptr<U> const& wp) noexcept : _ptr{ wp._ptr }, _control_block{ wp._control_block }
-        { if (_control_block) _control_block->inc_wref(); }
-        ~weak_ptr() { if (_control_block) _control_block->dec_wref(); }
-        weak_ptr& operator=(const weak_ptr& wp) noexcept {
-            weak_ptr{ wp }.swap(*this);
-            return *this;
+        std::size_t size() const noexcept { return _size; }
+        std::align_val_t alignment() const noexcept { return _align; }
+
+    private:
+        std::size_t _size = 0;
+        std::align_val_t _align = std::align_val_t{ alignof(T) };
+    };
+
+    // Background reclamation for deferred_delete. Deletions are collected in per-thread batches
+    // of batch_size and a full batch is handed to a single reclaimer thread, so the releasing
+    // thread pays one lock per batch instead of running destructors inline.
+    class deferred_reclaimer {
+    public:
+        using destroy_fn = void (*)(void*);
+        static constexpr std::size_t batch_size = 64;
+
+        // Queue p to be destroyed by fn on the reclaimer thread.
+        static void retire(void* p, destroy_fn fn) {
+            if (_exited() || _closed().load(std::memory_order_acquire)) {
+                fn(p); // batch or reclaimer already gone at exit
+                return;
+            }
+            _batch_t& b = _batch();
+            b.items.push_back({ p, fn });
+            if (b.items.size() >= batch_size)
+                flush();
         }
-        template<typename U>
-        weak_ptr& operator=(const weak_ptr<U>& wp) noexcept {
-            weak_ptr{ wp }.swap(*this);
-            return *this;
+
+        // Hand the deletions queued by the calling thread to the reclaimer thread without waiting.
+        static void flush() {
+            if (_exited())
+                return; // retire runs inline from here on
+            _batch_t& b = _batch();
+            if (b.items.empty())
+                return;
+            std::vector<_item> items;
+            items.reserve(batch_size);
+            items.swap(b.items);
+            _submit(std::move(items));
         }
-        template<typename U>
-        weak_ptr& operator=(const shared_ptr<U>& sp) noexcept {
-            weak_ptr{ sp }.swap(*this);
-            return *this;
+
+        // Flush, then block until the reclaimer thread is idle: every deletion handed to it so far,
+        // including the ones they cascade into, has run. Batches still held by other threads are not waited for.
+        static void drain() {
+            flush();
+            if (_closed().load(std::memory_order_acquire))
+                return;
+            deferred_reclaimer& r = _instance();
+            std::unique_lock<std::mutex> lock{ r._mutex };
+            r._idle.wait(lock, [&r] { return r._completed == r._submitted; });
         }
 
-        // Exchange contents of *this and sp.
-        void swap(weak_ptr& wp) noexcept {
-            using std::swap;
-            swap(_ptr, wp._ptr);
-            swap(_control_block, wp._control_block);
+    private:
+        struct _item {
+            void* p;
+            destroy_fn fn;
+        };
+
+        // Deletions queued by one thread, handed over when the thread exits
+        struct _batch_t {
+            _batch_t() { items.reserve(batch_size); }
+            ~_batch_t() {
+                std::vector<_item> last;
+                last.swap(items);
+                _exited() = true;
+                if (!last.empty())
+                    _submit(std::move(last));
+            }
+            std::vector<_item> items;
+        };
+
+        static _batch_t& _batch() {
+            static thread_local _batch_t b;
+            return b;
+        }
+        // Set once the batch of the calling thread is destroyed
+        static bool& _exited() noexcept {
+            static thread_local bool exited = false;
+            return exited;
         }
 
-        // Reset *this to empty.
-        void reset() noexcept { weak_ptr{}.swap(*this); }
+        static std::atomic<bool>& _closed() noexcept {
+            static std::atomic<bool> closed{ false };
+            return closed;
+        }
 
-        // Get use_count
-        long use_count() const noexcept { return (_control_block) ? _control_block->use_count() : 0; }
+        static deferred_reclaimer& _instance() {
+            static deferred_reclaimer r;
+            return r;
+        }
 
-        // Check if use_count == 0
-        bool expired() const noexcept { return (_control_block) ? _control_block->expired() : false; }
+        deferred_reclaimer() : _worker{ [this] { _run(); } } { }
 
-        // Check if there is a managed object
-        shared_ptr<T> lock() const noexcept { return (expired()) ? shared_ptr<T>{} : shared_ptr<T>{ *this }; }
+        // Stop the reclaimer thread after it ran everything queued, later deletions run inline.
+        ~deferred_reclaimer() {
+            {
+                std::lock_guard<std::mutex> lock{ _mutex };
+                _stop = true;
+                _closed().store(true, std::memory_order_release);
+            }
+            _work.notify_one();
+            _worker.join();
+        }
 
-        // Check whether this shared_ptr precedes other in owner-based order
-        // Implemented by comparing the address of control_block
-        template<typename U>
-        bool owner_before(shared_ptr<U> const& sp) const
-        {
-            return std::less<control_block_base*>()(_control_block, sp._control_block);
+        // Hand items to the reclaimer thread, or run them here once it is stopping or gone.
+        static void _submit(std::vector<_item> items) {
+            if (!_closed().load(std::memory_order_acquire)) {
+                deferred_reclaimer& r = _instance();
+                std::unique_lock<std::mutex> lock{ r._mutex };
+                if (!r._stop) {
+                    r._queue.push_back(std::move(items));
+                    ++r._submitted;
+                    lock.unlock();
+                    r._work.notify_one();
+                    return;
+                }
+            }
+            for (auto& i : items)
+                i.fn(i.p);
         }
-        // Check whether this shared_ptr precedes other in owner-based order
-        // Implemented by comparing the address of control_block
-        template<class U>
-        bool owner_before(weak_ptr<U> const& wp) const
-        {
-            return std::less<control_block_base*>()(_control_block, wp._control_block);
+
+        void _run() {
+            std::unique_lock<std::mutex> lock{ _mutex };
+            for (;;) {
+                _work.wait(lock, [this] { return _stop || !_queue.empty(); });
+                if (_queue.empty())
+                    break; // stopping and nothing left
+                std::vector<std::vector<_item>> queue;
+                queue.swap(_queue);
+                lock.unlock();
+                for (auto& items : queue)
+                    for (auto& i : items)
+                        i.fn(i.p);
+                flush(); // deletions cascaded from the destructors above
+                lock.lock();
+                _completed += queue.size();
+                if (_completed == _submitted)
+                    _idle.notify_all();
+            }
         }
 
-    private:
-        T* _ptr;
-        control_block_base* _control_block;
+        std::mutex _mutex;
+        std::condition_variable _work;
+        std::condition_variable _idle;
+        std::vector<std::vector<_item>> _queue;
+        unsigned long long _submitted = 0; // batches
+        unsigned long long _completed = 0;
+        bool _stop = false;
+        std::thread _worker;
     };
 
-    // Swap with another weak_ptr
-    template<typename T>
-    inline void swap(weak_ptr<T>& wp1, weak_ptr<T>& wp2) { wp1.swap(wp2); }
-
-    // Forward declarations.
-    template<typename T, typename D> class unique_ptr;
-    template<typename T> class shared_ptr;
-    template<typename T> class weak_ptr;
+    // Deleter that hands the object to deferred_reclaimer, so the thread dropping the last reference
+    // never runs a (possibly cascading) destructor. D must be stateless, a value-initialized one destroys it.
+    template <typename T, typename D = default_delete<T>>
+    class deferred_delete {
+        static_assert(std::is_empty<D>::value, "deferred_delete requires a stateless deleter");
+        using _Elt = typename std::remove_extent<T>::type;
 
-    // Define operator*, operator-> and operator[] for T not array or cv void
-    template<typename T, bool = std::is_array<T>::value, bool = std::is_void<T>::value>
-    class shared_ptr_access {
     public:
-        using element_type = T;
+        // Default ctor.
+        constexpr deferred_delete() noexcept = default;
+        // Converting ctor, convertibility is not checked.
+        template <typename U, typename E>
+        deferred_delete(const deferred_delete<U, E>&) noexcept { }
 
-        // Dereference pointer to the managed object
-        T& operator*() const noexcept { assert(_get() != nullptr); return *_get(); }
-        T* operator->() const noexcept { assert(_get() != nullptr); return _get(); }
+        // Call operator: queue the object for destruction.
+        void operator()(_Elt* p) const {
+            if (p)
+                deferred_reclaimer::retire(const_cast<void*>(static_cast<const volatile void*>(p)), &_destroy);
+        }
 
     private:
-        T* _get() const noexcept { return static_cast<const shared_ptr<T>*>(this)->get(); }
+        static void _destroy(void* p) { D{}(static_cast<_Elt*>(p)); }
     };
 
-    // Specialization of shared_ptr_access for T array type. Defines operator[] for shared_ptr<T[]> and shared_ptr<T[N]>
-    template<typename T>
-    class shared_ptr_access<T, true, false> {
+    // Reference counter policy for objects shared between threads (the default).
+    class atomic_counter {
     public:
-        using element_type = typename std::remove_extent<T>::type;
+        using type = std::atomic<long>;
+        using weak_counter = atomic_counter;
 
-        // Index operator, dereferencing operators are not provided.
-        T* operator[](std::ptrdiff_t i) const noexcept
-        {
-            assert(_get() != nullptr);
-            static_assert(!std::extent<T>::value || i < std::extent<T>::value);
-            return _get()[i];
+        // Called by the control block constructor
+        template<typename B>
+        static void attach(type&, B*) noexcept { }
+
+        // A new reference is always made from an existing one, so increments need no ordering.
+        static void increment(type& c, long n = 1) noexcept { c.fetch_add(n, std::memory_order_relaxed); }
+
+        // Decrements release this thread's accesses to the object; the thread that drops the
+        // last reference acquires them all before destroying anything.
+        // Return true if the count dropped to 0.
+        static bool decrement(type& c, long n = 1) noexcept {
+            if (c.fetch_sub(n, std::memory_order_release) == n) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                return true;
+            }
+            return false;
         }
 
-    private:
-        T* _get() const noexcept { return static_cast<const shared_ptr<T>*>(this)->get(); }
+        // Increment unless the count is 0, a weak_ptr upgrade. Acquire on success so the
+        // upgraded reference sees accesses released by other references.
+        static bool increment_if_not_zero(type& c) noexcept {
+            long n = c.load(std::memory_order_relaxed);
+            while (n != 0) {
+                if (c.compare_exchange_weak(n, n + 1, std::memory_order_acquire, std::memory_order_relaxed))
+                    return true;
+            }
+            return false;
+        }
+
+        static long load(const type& c) noexcept { return c.load(std::memory_order_relaxed); }
+        static long load_acquire(const type& c) noexcept { return c.load(std::memory_order_acquire); }
     };
 
-    // Specialization of shared_ptr_access for T cv void type. Defines operator-> for shared_ptr<cv void>
-    template<typename T>
-    class shared_ptr_access<T, false, true> {
+    // Reference counter policy for objects that never leave the thread that created them.
+    // Plain integers, no atomic instructions or fences.
+    class local_counter {
     public:
-        // Dereference pointer to the managed object, operator* is not provided
-        T* operator->() const noexcept { assert(_get() != nullptr); return _get(); }
+        using type = long;
+        using weak_counter = local_counter;
 
-    private:
-        T* _get() const noexcept { return static_cast<const shared_ptr<T>*>(this)->get(); }
+        template<typename B>
+        static void attach(type&, B*) noexcept { }
+
+        static void increment(type& c, long n = 1) noexcept { c += n; }
+        static bool decrement(type& c, long n = 1) noexcept { return (c -= n) == 0; }
+        static bool increment_if_not_zero(type& c) noexcept { return (c != 0) ? (++c, true) : false; }
+        static long load(const type& c) noexcept { return c; }
+        static long load_acquire(const type& c) noexcept { return c; }
     };
 
-    // shared_ptr implementation.
-    template<typename T>
-    class shared_ptr : public shared_ptr_access<T> {
+    // Reference counter policy biased towards the thread that created the object: it counts with plain
+    // stores, other threads on an atomic shared count that may go negative. The remote decrement that turns it
+    // negative queues the block to the owner, which merges on its next decrement, merge_pending() or exit.
+    class biased_counter {
+        struct _record;
+
     public:
-        template<typename U> friend class shared_ptr;
-        template<typename U> friend class weak_ptr;
-        template<typename D, typename U> friend D* get_deleter(const shared_ptr<U>&) noexcept;
+        using weak_counter = atomic_counter;
 
-        using element_type = typename shared_ptr_access<T>::element_type;
-        using weak_type = weak_ptr<T>; /* added in C++17 */
+        struct type {
+            explicit type(long n) noexcept : type{ _self(), n } { }
+            // Without a record for this thread the block starts merged, on the shared count alone
+            type(_record* r, long n) noexcept : owner{ r }, local{ r ? n : 0 }, shared{ r ? 0 : n * _one | _merged } {
+                if (r)
+                    r->owned.fetch_add(1, std::memory_order_relaxed);
+            }
 
-        // Default ctor, creates a shared_ptr with no managed object
-        // Postconditions: use_count() == 0 && get() == 0.
-        constexpr shared_ptr() noexcept : _ptr{}, _control_block{} { }
-        // Construct a shared_ptr with no managed object
-        // Postconditions: use_count() == 0 && get() == 0.
-        constexpr shared_ptr(std::nullptr_t) noexcept : _ptr{}, _control_block{} { }
-        // Construct a shared_ptr with p as the pointer to the managed object
-        // Postconditions: use_count() == 1 && get() == p. 
-        template<typename U>
-        explicit shared_ptr(U* p) : _ptr{ p }, _control_block{ new control_block<U>{p} } { }
-        // Construct a shared_ptr with p as the pointer to the managed object, supplied with custom deleter
-        // Postconditions: use_count() == 1 && get() == p.
-        template<typename U, typename D>
-        shared_ptr(U* p, D d) : _ptr{ p }, _control_block{ new control_block<U, D>{p, std::move(d)} } { }
-        // Construct a shared_ptr with p as the pointer to the managed object, supplied with custom deleter and allocator
-        // Postconditions: use_count() == 1 && get() == p.
-        template<typename U, typename D, typename A>
-        shared_ptr(U* p, D d, A a) = delete;
-        // Construct a shared_ptr with no managed object, supplied with custom deleter
-        // Postconditions: use_count() == 1 && get() == 0.
-        template<typename D>
-        shared_ptr(std::nullptr_t p, D d) : _ptr{ nullptr }, _control_block{ new control_block<T, D>{p, std::move(d)} } { }
-        // Construct a shared_ptr with no managed object, supplied with custom deleter and allocator
-        // Postconditions: use_count() == 1 && get() == 0.
-        template<typename D, typename A>
-        shared_ptr(std::nullptr_t p, D d, A a) = delete;
-        // Aliasing ctor: constructs a shared_ptr instance that stores p and shares ownership with sp
-        // Postconditions: use_count() == sp.use_count() && get() == p.
-        template<typename U>
-        shared_ptr(const shared_ptr<U>& sp, T* p) noexcept : _ptr{ p }, _control_block{ sp._control_block }
-        { if (_control_block) _control_block->inc_ref(); }
-        // Copy ctor: shares ownership of the object managed by sp
-        // Postconditions: use_count() == sp.use_count() && get() == sp.get().
-        shared_ptr(const shared_ptr& sp) noexcept : _ptr{ sp._ptr }, _control_block{ sp._control_block }
-        { if (_control_block) _control_block->inc_ref(); }
-        // Copy ctor: shares ownership of the object managed by sp
-        // Postconditions: use_count() == sp.use_count() && get() == sp.get().
-        template<typename U>
-        shared_ptr(const shared_ptr<U>& sp) noexcept : _ptr{ sp._ptr }, _control_block{ sp._control_block }
-        { if (_control_block) _control_block->inc_ref(); }
-        // Move ctor: Move-constructs a shared_ptr from sp
-        // Postconditions: *this shall contain the old value of sp.
-        // sp shall be empty. sp.get() == 0.
-        shared_ptr(shared_ptr&& sp) noexcept : _ptr{ std::move(sp._ptr) }, _control_block{ std::move(sp._control_block) } {
-            sp._ptr = nullptr;
-            sp._control_block = nullptr;
-        }
-        // Move ctor: Move-constructs a shared_ptr from sp
-        // Postconditions: *this shall contain the old value of sp.
-        //     sp shall be empty. sp.get() == 0.
-        template<typename U>
-        shared_ptr(shared_ptr<U>&& sp) noexcept : _ptr{ sp._ptr }, _control_block{ sp._control_block } {
-            sp._ptr = nullptr;
-            sp._control_block = nullptr;
+            std::atomic<_record*> owner;    // nullptr once merged
+            std::atomic<long> local;        // owner's count, plain load and store
+            std::atomic<long> shared;       // remote count * _one | _queued | _merged
+            type* next = nullptr;           // owner's merge queue link
+            void* block = nullptr;          // control block, to release it after a queued merge
+            void (*release)(void*) = nullptr;
+        };
+
+        // Called by the control block constructor
+        template<typename B>
+        static void attach(type& c, B* cb) noexcept {
+            c.block = cb;
+            c.release = [](void* b) { static_cast<B*>(b)->dec_ref(); };
         }
-        // Constructsa shared_ptr object that shares ownership with wp
-        // Postconditions: use_count() == wp.use_count().
-        template<typename U>
-        explicit shared_ptr(const weak_ptr<U>& wp) : _ptr{ wp._ptr }, _control_block{ wp._control_block } {
-            if (wp.expired())
-                throw bad_weak_ptr{};
+
+        static void increment(type& c, long n = 1) noexcept {
+            _record* self = _self();
+            if (self && c.owner.load(std::memory_order_relaxed) == self)
+                c.local.store(c.local.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
             else
-                _control_block->inc_ref();
-        }
-        // Construct a shared_ptr object that obtains ownership from up
-        // Postconditions: use_count() == 1. up shall be empty. up.get() = 0.
-        template<typename U, typename D>
-        shared_ptr(unique_ptr<U, D>&& up) : shared_ptr{ up.release(), up.get_deleter() } { }
-        ~shared_ptr() { if (_control_block) _control_block->dec_ref(); }
-        // Copy assignment
-        shared_ptr& operator=(const shared_ptr& sp) noexcept {
-            shared_ptr{ sp }.swap(*this);
-            return *this;
+                c.shared.fetch_add(n * _one, std::memory_order_relaxed);
         }
-        template<typename U>
-        shared_ptr& operator=(const shared_ptr<U>& sp) noexcept {
-            shared_ptr{ sp }.swap(*this);
-            return *this;
+
+        // Return true if the count dropped to 0.
+        static bool decrement(type& c, long n = 1) noexcept {
+            _record* self = _self();
+            if (self && c.owner.load(std::memory_order_relaxed) == self) {
+                long l = c.local.load(std::memory_order_relaxed) - n;
+                c.local.store(l, std::memory_order_relaxed);
+                bool dead = false;
+                if (l == 0) {
+                    c.owner.store(nullptr, std::memory_order_relaxed);
+                    long s = c.shared.fetch_or(_merged, std::memory_order_acq_rel);
+                    dead = !(s & _queued) && _count(s) == 0; // a queued block is released by the merge
+                    _disown(self);
+                }
+                // Last, the merge may release c itself
+                if (self->head.load(std::memory_order_relaxed))
+                    _merge_queue(self);
+                return dead;
+            }
+            long s = c.shared.load(std::memory_order_relaxed);
+            long d;
+            do {
+                d = s - n * _one;
+                if (!(s & (_merged | _queued)) && _count(d) < 0)
+                    d |= _queued;
+            } while (!c.shared.compare_exchange_weak(s, d, std::memory_order_acq_rel, std::memory_order_relaxed));
+            if ((d & _queued) && !(s & _queued)) {
+                _enqueue(c);
+                return false;
+            }
+            return (s & _merged) && !(s & _queued) && _count(d) == 0;
         }
-        // Move assignment
-        shared_ptr& operator=(shared_ptr&& sp) noexcept {
-            shared_ptr{ std::move(sp) }.swap(*this);
-            return *this;
+
+        // While unmerged the owner holds a local count, so the object cannot have been destroyed.
+        static bool increment_if_not_zero(type& c) noexcept {
+            _record* self = _self();
+            if (self && c.owner.load(std::memory_order_relaxed) == self && c.local.load(std::memory_order_relaxed) != 0) {
+                increment(c);
+                return true;
+            }
+            long s = c.shared.load(std::memory_order_relaxed);
+            while (!(s & _merged) || _count(s) != 0) {
+                if (c.shared.compare_exchange_weak(s, s + _one, std::memory_order_acquire, std::memory_order_relaxed))
+                    return true;
+            }
+            return false;
         }
-        template<typename U>
-        shared_ptr& operator=(shared_ptr<U>&& sp) noexcept {
-            shared_ptr{ std::move(sp) }.swap(*this);
-            return *this;
+
+        // Approximate while other threads are counting
+        static long load(const type& c) noexcept {
+            long s = c.shared.load(std::memory_order_relaxed);
+            return _count(s) + ((s & _merged) ? 0 : c.local.load(std::memory_order_relaxed));
         }
-        // Move assignment from a unique_ptr
-        template<typename U, typename D>
-        shared_ptr& operator=(unique_ptr<U, D>&& up) noexcept {
-            shared_ptr{ std::move(up) }.swap(*this);
-            return *this;
+        static long load_acquire(const type& c) noexcept {
+            long s = c.shared.load(std::memory_order_acquire);
+            return _count(s) + ((s & _merged) ? 0 : c.local.load(std::memory_order_acquire));
         }
 
-        // Exchange the contents of *this and sp
-        void swap(shared_ptr& sp) noexcept {
-            using std::swap;
-            swap(_ptr, sp._ptr);
-            swap(_control_block, sp._control_block);
+        // Merge the blocks other threads queued to the calling thread, releasing those that died.
+        static void merge_pending() noexcept {
+            if (_record* self = _self())
+                _merge_queue(self);
         }
 
-        // Reset *this to empty
-        void reset() noexcept { shared_ptr{}.swap(*this); }
-        // Reset *this with p as the pointer to the managed object
-        template<typename U>
-        void reset(U* p) { shared_ptr{ p }.swap(*this); }
-        // Reset *this with p as the pointer to the managed object, supplied with custom deleter
-        template<typename U, typename D>
-        void reset(U* p, D d) { shared_ptr{ p, d }.swap(*this); }
-        // Reset *this with p as the pointer to the managed object, supplied with custom deleter and allocator
-        template<typename U, typename D, typename A>
-        void reset(U* p, D d, A a) = delete;
+    private:
+        static constexpr long _merged = 1;
+        static constexpr long _queued = 2;
+        static constexpr long _one = 4;
 
-        // Get the stored pointer
-        T* get() const noexcept { return _ptr; }
+        static long _count(long s) noexcept { return (s & ~(_one - 1)) / _one; }
 
-        // Get use_count
-        long use_count() const noexcept { return (_control_block) ? _control_block->use_count() : 0; }
+        // Merge queue of one thread, reused by a new thread once no block names it as owner.
+        struct _record {
+            std::atomic<type*> head{ nullptr };
+            std::atomic<long> owned{ 1 };    // blocks naming it as owner, + 1 while its thread runs
+            std::atomic<bool> idle{ false }; // free for a new thread
+            _record* next = nullptr;
+        };
 
-        // deprecated in C++17, removed in C++20
-        // Check if use_count == 1
-        bool unique() const noexcept { return (_control_block) ? _control_block->unique() : false; }
+        static std::atomic<_record*>& _records() noexcept {
+            static std::atomic<_record*> head{ nullptr };
+            return head;
+        }
 
-        // Check if there is a managed object
-        explicit operator bool() const noexcept { return (_ptr) ? true : false; }
+        static type* _closed() noexcept { return reinterpret_cast<type*>(std::uintptr_t{ 1 }); }
 
-        // Check whether this shared_ptr precedes other in owner-based order
-        // Implemented by comparing the address of control_block
-        template<typename U>
-        bool owner_before(shared_ptr<U> const& sp) const {
-            return std::less<control_block_base*>()(_control_block, sp._control_block);
+        // Drop one of the owned references of r, the last one makes it idle
+        static void _disown(_record* r) noexcept {
+            if (r->owned.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                r->idle.store(true, std::memory_order_release);
         }
 
-        // Check whether this shared_ptr precedes other in owner-based order
-        // Implemented by comparing the address of control_block
-        template<class U>
-        bool owner_before(weak_ptr<U> const& wp) const {
-            return std::less<control_block_base*>()(_control_block, wp._control_block);
+        struct _local_t {
+            _record* self;
+            bool exited;
+        };
+        static _local_t& _local() noexcept {
+            static thread_local _local_t l{ nullptr, false };
+            return l;
         }
 
-    private:
-        T* _ptr;
-        control_block_base* _control_block;
-    };
+        // Close the queue at thread exit. Destructors running later count on the shared count.
+        struct _holder_t {
+            ~_holder_t() {
+                _local_t& l = _local();
+                _record* r = l.self;
+                l.self = nullptr;
+                l.exited = true;
+                _merge_list(r, r->head.exchange(_closed(), std::memory_order_acq_rel));
+                _disown(r);
+            }
+        };
 
-    // Create a shared_ptr that manages a new object.
-    template<typename T, typename... Args>
-    inline shared_ptr<T> make_shared(Args&&... args) { return shared_ptr<T>{new T{ std::forward<Args>(args)... }}; }
+        // Record of the calling thread, nullptr during thread exit or if none could be allocated
+        static _record* _self() noexcept {
+            _local_t& l = _local();
+            if (!l.self && !l.exited && (l.self = _acquire_record()) != nullptr) {
+                static thread_local _holder_t _holder;
+                (void)_holder;
+            }
+            return l.self;
+        }
 
-    template<typename T, typename A, typename... Args>
-    inline shared_ptr<T> allocate_shared(const A& a, Args&&... args) = delete;
+        static _record* _acquire_record() noexcept {
+            for (_record* r = _records().load(std::memory_order_acquire); r; r = r->next) {
+                bool idle = true;
+                if (r->idle.load(std::memory_order_relaxed) && r->idle.compare_exchange_strong(idle, false, std::memory_order_acquire)) {
+                    r->owned.store(1, std::memory_order_relaxed);
+                    r->head.store(nullptr, std::memory_order_release);
+                    return r;
+                }
+            }
+            auto* r = new (std::nothrow) _record;
+            if (!r)
+                return nullptr;
+            r->next = _records().load(std::memory_order_relaxed);
+            while (!_records().compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed)) { }
+            return r;
+        }
 
-    // Operator overloading.
-    template<typename T, typename U>
-    inline bool operator==(const shared_ptr<T>& sp1, const shared_ptr<U>& sp2) { return sp1.get() == sp2.get(); }
-    template<typename T>
-    inline bool operator==(const shared_ptr<T>& sp, std::nullptr_t) noexcept { return !sp; }
-    template<typename T>
-    inline bool operator==(std::nullptr_t, const shared_ptr<T>& sp) noexcept { return !sp; }
+        static void _enqueue(type& c) noexcept {
+            _record* r = c.owner.load(std::memory_order_relaxed);
+            if (!r) {
+                _merge(r, c); // the owner's count just dropped to 0
+                return;
+            }
+            type* h = r->head.load(std::memory_order_acquire);
+            do {
+                if (h == _closed()) {
+                    _merge(r, c); // the owner exited, nobody else counts locally
+                    return;
+                }
+                c.next = h;
+            } while (!r->head.compare_exchange_weak(h, &c, std::memory_order_release, std::memory_order_acquire));
+        }
 
-    template<typename T, typename U>
-    inline bool operator!=(const shared_ptr<T>& sp1, const shared_ptr<U>& sp2) { return sp1.get() != sp2.get(); }
-    template<typename T>
-    inline bool operator!=(const shared_ptr<T>& sp, std::nullptr_t) noexcept { return bool{ sp }; }
-    template<typename T>
-    inline bool operator!=(std::nullptr_t, const shared_ptr<T>& sp) noexcept { return bool{ sp }; }
+        static void _merge_queue(_record* r) noexcept {
+            type* h = r->head.load(std::memory_order_relaxed);
+            if (h && h != _closed())
+                _merge_list(r, r->head.exchange(nullptr, std::memory_order_acquire));
+        }
 
-    template<typename T, typename U>
-    inline bool operator<(const shared_ptr<T>& sp1, const shared_ptr<U>& sp2) {
-        using _Tp_elt = typename shared_ptr<T>::element_type;
-        using _Up_elt = typename shared_ptr<U>::element_type;
-        using _CT = typename std::common_type<_Tp_elt*, _Up_elt*>::type;
-        return std::less<_CT>()(sp1.get(), sp2.get());
-    }
-    template<typename T>
-    inline bool operator<(const shared_ptr<T>& sp, std::nullptr_t) {
-        using _Tp_elt = typename shared_ptr<T>::element_type;
-        return std::less<_Tp_elt*>()(sp.get(), nullptr);
-    }
-    template<typename T>
-    inline bool operator<(std::nullptr_t, const shared_ptr<T>& sp) {
-        using _Tp_elt = typename shared_ptr<T>::element_type;
-        return std::less<_Tp_elt*>()(nullptr, sp.get());
-    }
+        static void _merge_list(_record* r, type* h) noexcept {
+            while (h && h != _closed()) {
+                type* next = h->next;
+                _merge(r, *h);
+                h = next;
+            }
+        }
 
-    template<typename T, typename U>
-    inline bool operator<=(const shared_ptr<T>& sp1, const shared_ptr<U>& sp2) { return !(sp2.get() < sp1.get()); }
-    template<typename T>
-    inline bool operator<=(const shared_ptr<T>& sp, std::nullptr_t) { return !(nullptr < sp.get()); }
-    template<typename T>
-    inline bool operator<=(std::nullptr_t, const shared_ptr<T>& sp) { return !(sp.get() < nullptr); }
+        // Fold the local count of r into the shared count, holding a temporary reference over
+        // clearing _queued, then drop it through the control block so a dead block is released.
+        static void _merge(_record* r, type& c) noexcept {
+            if (r && c.owner.load(std::memory_order_acquire) == r) {
+                long l = c.local.load(std::memory_order_relaxed);
+                c.local.store(0, std::memory_order_relaxed);
+                c.owner.store(nullptr, std::memory_order_relaxed);
+                c.shared.fetch_add((l + 1) * _one + _merged, std::memory_order_acq_rel);
+                _disown(r);
+            }
+            else
+                c.shared.fetch_add(_one, std::memory_order_relaxed);
+            c.shared.fetch_and(~_queued, std::memory_order_acq_rel);
+            c.release(c.block);
+        }
+    };
 
-    template<typename T, typename U>
-    inline bool operator>(const shared_ptr<T>& sp1, const shared_ptr<U>& sp2) { return sp2.get() < sp1.get(); }
-    template<typename T>
-    inline bool operator>(const shared_ptr<T>& sp, std::nullptr_t) { return nullptr < sp.get(); }
-    template<typename T>
-    inline bool operator>(std::nullptr_t, const shared_ptr<T>& sp) { return sp.get() < nullptr; }
+#if SP_REFCOUNT_STATS
+    // Reference counting statistics of the control blocks managing one type, for finding hot or shared counts.
+    // Counters are relaxed and approximate under contention. Allocated once per type and never freed.
+    struct refcount_stats {
+        const char* name;                           // typeid(T).name() of the managed type
+        std::atomic<unsigned long long> allocations;
+        std::atomic<unsigned long long> increments; // shared references taken, weak locks excluded
+        std::atomic<unsigned long long> decrements;
+        std::atomic<unsigned long long> weak_increments;
+        std::atomic<unsigned long long> weak_decrements;
+        std::atomic<unsigned long long> weak_locks;
+        std::atomic<unsigned long long> failed_weak_locks;
+        // Operations done by another thread than the one that created the block, each one
+        // a likely cache line transfer of the counters
+        std::atomic<unsigned long long> remote_operations;
+        std::atomic<long> peak_use_count;
+        refcount_stats* next;                       // registry link
 
-    template<typename T, typename U>
-    inline bool operator>=(const shared_ptr<T>& sp1, const shared_ptr<U>& sp2) { return !(sp1.get() < sp2.get()); }
-    template<typename T>
-    inline bool operator>=(const shared_ptr<T>& sp, std::nullptr_t) { return !(sp.get() < nullptr); }
-    template<typename T>
-    inline bool operator>=(std::nullptr_t, const shared_ptr<T>& sp) { return !(nullptr < sp.get()); }
+        // Statistics of T, registered on first use
+        template<typename T>
+        static refcount_stats& of() noexcept {
+            static refcount_stats* s = _register(typeid(T).name());
+            return *s;
+        }
 
-    // Swap with another shared_ptr.
-    template<typename T>
-    inline void swap(shared_ptr<T>& sp1, shared_ptr<T>& sp2) { sp1.swap(sp2); }
+        // First registered entry, follow next for the others
+        static refcount_stats* first() noexcept { return _head().load(std::memory_order_acquire); }
 
-    // shared_ptr casts
-    template<typename T, typename U>
-    inline shared_ptr<T> static_pointer_cast(const shared_ptr<U>& sp) noexcept {
-        using _Sp = shared_ptr<T>;
-        return _Sp(sp, static_cast<typename _Sp::element_type*>(sp.get()));
-    }
-    template<typename T, typename U>
-    inline shared_ptr<T> const_pointer_cast(const shared_ptr<U>& sp) noexcept {
-        using _Sp = shared_ptr<T>;
-        return _Sp(sp, const_cast<typename _Sp::element_type*>(sp.get()));
-    }
-    template<typename T, typename U>
-    inline shared_ptr<T> dynamic_pointer_cast(const shared_ptr<U>& sp) noexcept {
-        using _Sp = shared_ptr<T>;
-        if (auto* _p = dynamic_cast<typename _Sp::element_type*>(sp.get()))
-            return _Sp(sp, _p);
-        return _Sp();
-    }
-    // Added in C++17 
-    template<typename T, typename U>
-    inline shared_ptr<T> reinterpret_pointer_cast(const shared_ptr<U>& sp) noexcept {
-        using _Sp = shared_ptr<T>;
-        return _Sp(sp, reinterpret_cast<typename _Sp::element_type*>(sp.get()));
+        void add(std::atomic<unsigned long long>& counter, long n = 1) noexcept { counter.fetch_add(static_cast<unsigned long long>(n), std::memory_order_relaxed); }
+
+        void note_use_count(long uses) noexcept {
+            long peak = peak_use_count.load(std::memory_order_relaxed);
+            while (uses > peak && !peak_use_count.compare_exchange_weak(peak, uses, std::memory_order_relaxed)) { }
+        }
+
+        void reset() noexcept {
+            for (auto* c : { &allocations, &increments, &decrements, &weak_increments, &weak_decrements,
+                             &weak_locks, &failed_weak_locks, &remote_operations })
+                c->store(0, std::memory_order_relaxed);
+            peak_use_count.store(0, std::memory_order_relaxed);
+        }
+
+    private:
+        static std::atomic<refcount_stats*>& _head() noexcept {
+            static std::atomic<refcount_stats*> head{ nullptr };
+            return head;
+        }
+
+        static refcount_stats* _register(const char* name) {
+            auto* s = new refcount_stats{ name, {0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}, nullptr };
+            s->next = _head().load(std::memory_order_relaxed);
+            while (!_head().compare_exchange_weak(s->next, s, std::memory_order_release, std::memory_order_relaxed)) { }
+            return s;
+        }
+    };
+
+    // Call f(const refcount_stats&) for the statistics of every type seen so far.
+    template<typename F>
+    inline void for_each_refcount_stats(F f) {
+        for (const refcount_stats* s = refcount_stats::first(); s; s = s->next)
+            f(*s);
     }
 
-    // shared_ptr get_deleter
-    template<typename D, typename T>
-    inline D* get_deleter(const shared_ptr<T>& sp) noexcept { return reinterpret_cast<D*>(sp._control_block->get_deleter()); }
+    // Clear the statistics of every type seen so far.
+    inline void reset_refcount_stats() noexcept {
+        for (refcount_stats* s = refcount_stats::first(); s; s = s->next)
+            s->reset();
+    }
 
-    // shared_ptr I/O
-    template<class E, class T, class Y>
-    inline std::basic_ostream<E, T>&
-        operator<<(std::basic_ostream<E, T>& os, const shared_ptr<Y>& sp) {
-        os << sp.get();
-        return os;
+    // Print one line per type.
+    template<typename E, typename T>
+    inline void dump_refcount_stats(std::basic_ostream<E, T>& os) {
+        for_each_refcount_stats([&os](const refcount_stats& s) {
+            os << s.name << ": allocations=" << s.allocations.load() << " increments=" << s.increments.load()
+               << " decrements=" << s.decrements.load() << " weak_increments=" << s.weak_increments.load()
+               << " weak_decrements=" << s.weak_decrements.load() << " weak_locks=" << s.weak_locks.load()
+               << " failed_weak_locks=" << s.failed_weak_locks.load() << " remote_operations=" << s.remote_operations.load()
+               << " peak_use_count=" << s.peak_use_count.load() << '\n';
+        });
     }
+#endif
+
+    // Control block base, holds the reference counters shared by every control block. Counting is not
+    // virtual so it inlines into shared_ptr and weak_ptr, only destruction and get_deleter are.
+    // C is the reference counter policy, C::weak_counter counts the weak references.
+    template<typename C = atomic_counter>
+    class control_block_base {
+        using _W = typename C::weak_counter;
 
-    // unique_ptr for single objects.
-    template<typename T, typename D = default_delete<T>>
-    class unique_ptr {
     public:
-        using pointer = T*;
-        using deleter_type = D;
+        using counter_type = C;
 
-        // Default ctor, creates a unique_ptr that owns nothing.
-        constexpr unique_ptr() noexcept = default;
-        // Construct with nullptr, creates a unique_ptr that owns nothing
-        constexpr unique_ptr(std::nullptr_t) noexcept { }
-        // Take ownership from a pointer
-        explicit unique_ptr(T* p) noexcept : _impl{ p } { }
-        // Take ownership from a pointer, supplied with a custom deleter
-        // d: a reference to a deleter.
-        unique_ptr(T* p, typename std::conditional<std::is_reference<deleter_type>::value, deleter_type, const deleter_type&>::type d) noexcept : _impl{ p, d } { }
-        // Take ownership from a pointer, supplied with a custom deleter
-        // d: an rvalue reference to a deleter.
-        // Not permitted if deleter_type is an lvalue reference.
-        unique_ptr(T* p, typename std::remove_reference<deleter_type>::type&& d) noexcept : _impl{ p, std::move(d) } 
-        { static_assert(!std::is_reference<deleter_type>::value, "rvalue deleter bound to reference"); }
-        // Move ctor: takes ownership from a unique_ptr of the same type
-        unique_ptr(unique_ptr&& up) noexcept : _impl{ up.release(), std::forward<deleter_type>(up.get_deleter()) } { }
-        // Move ctor: takes ownership from a unique_ptr of a different type
-        template <typename U, typename E>
-        unique_ptr(unique_ptr<U, E>&& up) noexcept : _impl{ up.release(), std::forward<deleter_type>(up.get_deleter()) } { }
-        // Invoke the deleter if the stored pointer is not null
-        ~unique_ptr() noexcept {
-            auto _ptr = _impl._impl_ptr();
-            auto& _deleter = _impl._impl_deleter();
-            if (_ptr)
-                _deleter(_ptr);
+        // n > 1 takes or drops several references with a single operation
+        void inc_ref(long n = 1) noexcept {
+            C::increment(_use_count, n);
+#if SP_REFCOUNT_STATS
+            _record(_stats->increments, n);
+            _stats->note_use_count(C::load(_use_count));
+#endif
         }
-        // Move assignment: takes ownership from a unique_ptr of the same type
-        unique_ptr& operator=(unique_ptr&& up) noexcept {
-            reset(up.release());
-            auto& _deleter = _impl._impl_deleter();
-            _deleter = up.get_deleter();
-            return *this;
+        void inc_wref() noexcept {
+            _W::increment(_weak_use_count);
+#if SP_REFCOUNT_STATS
+            _record(_stats->weak_increments);
+#endif
         }
-        // Move assignment: takes ownership from a unique_ptr of a different type
-        template <typename U, typename E>
-        unique_ptr& operator=(unique_ptr<U, E>&& up) noexcept {
-            reset(up.release());
-            auto& _deleter = _impl._impl_deleter();
-            _deleter = up.get_deleter();
-            return *this;
+        // Take a reference only if the object is still alive, return false if it expired
+        bool inc_ref_nz() noexcept {
+#if SP_REFCOUNT_STATS
+            bool locked = C::increment_if_not_zero(_use_count);
+            _record(locked ? _stats->weak_locks : _stats->failed_weak_locks);
+            return locked;
+#else
+            return C::increment_if_not_zero(_use_count);
+#endif
         }
-        // Reset unique_ptr to empty if assigned to nullptr 
-        unique_ptr& operator=(std::nullptr_t) noexcept {
-            reset();
-            return *this;
+
+        void dec_ref(long n = 1) noexcept {
+#if SP_REFCOUNT_STATS
+            _record(_stats->decrements, n);
+#endif
+            if (C::decrement(_use_count, n)) {
+                dispose(); // destroy the managed object
+                dec_wref();
+            }
         }
 
-        // Dereference pointer to the managed object
-        T& operator*() const noexcept {
-            auto _ptr = _impl._impl_ptr();
-            assert(_ptr != nullptr);
-            return *_ptr;
+        void dec_wref() noexcept {
+#if SP_REFCOUNT_STATS
+            _record(_stats->weak_decrements);
+#endif
+            if (_W::decrement(_weak_use_count))
+                destroy(); // destroy control_block itself
         }
-        T* operator->() const noexcept {
-            auto _ptr = _impl._impl_ptr();
-            assert(_ptr != nullptr);
-            return _ptr;
+
+        // Return #shared_ptr
+        long use_count() const noexcept { return C::load(_use_count); }
+
+        // Acquire so that accesses made through other, already released, shared_ptr are visible
+        bool unique() const noexcept { return C::load_acquire(_use_count) == 1; }
+
+        // Return #weak_ptr
+        long weak_use_count() const noexcept {
+            long _uses = C::load(_use_count);
+            return _W::load(_weak_use_count) - ((_uses > 0) ? 1 : 0);
         }
 
-        // Get the stored pointer
-        T* get() const noexcept { return _impl._impl_ptr(); }
+        bool expired() const noexcept { return C::load_acquire(_use_count) == 0; }
 
-        // Get a reference to the stored deleter
-        deleter_type& get_deleter() noexcept { return _impl._impl_deleter(); }
+        // Type erasure for storing deleter
+        virtual void* get_deleter() noexcept = 0;
 
-        // Get a const reference to the stored deleter
-        const deleter_type& get_deleter() const noexcept { return _impl._impl_deleter(); }
+    protected:
+        control_block_base() noexcept { C::attach(_use_count, this); }
+        virtual ~control_block_base() { };
 
-        // Check if there is an associated managed object
-        explicit operator bool() const noexcept { return (_impl._impl_ptr()) ? true : false; }
+        // Destroy the managed object, called when use_count drops to 0
+        virtual void dispose() noexcept = 0;
+        // Release the control block, called when weak_use_count drops to 0
+        virtual void destroy() noexcept = 0;
 
-        // Release ownership to the returned raw pointer
-        T* release() noexcept {
-            auto& _ptr = _impl._impl_ptr();
-            T* cp = _ptr;
-            _ptr = nullptr;
-            return cp;
+        // Called by the constructor of every block managing a T, attributes its counting
+        // to refcount_stats::of<T>(). Does nothing unless SP_REFCOUNT_STATS is set.
+        template<typename T>
+        void _track() noexcept {
+#if SP_REFCOUNT_STATS
+            _stats = &refcount_stats::of<T>();
+            _owner = _thread_tag();
+            _stats->add(_stats->allocations);
+            _stats->note_use_count(1);
+#endif
         }
 
-        // Reset unique_ptr to empty and takes ownership from a pointer
-        void reset(T* p) noexcept {
-            auto& _ptr = _impl._impl_ptr();
-            auto& _deleter = _impl._impl_deleter();
-            if (_ptr)
-                _deleter(_ptr);
-            _ptr = p;
-        }
-        // Reset unique_ptr to empty
-        void reset() noexcept {
-            auto& _ptr = _impl._impl_ptr();
-            auto& _deleter = _impl._impl_deleter();
-            if (_ptr)
-                _deleter(_ptr);
-            _ptr = pointer{}; // probably nullptr
+    private:
+#if SP_REFCOUNT_STATS
+        static const void* _thread_tag() noexcept {
+            static thread_local char tag;
+            return &tag;
         }
 
-        // Swap with another unique_ptr
-        void swap(unique_ptr& up) noexcept {
-            using std::swap;
-            swap(_impl, up._impl);
+        void _record(std::atomic<unsigned long long>& counter, long n = 1) noexcept {
+            _stats->add(counter, n);
+            if (_owner != _thread_tag())
+                _stats->add(_stats->remote_operations);
         }
 
-        // Disable copy from lvalue, disable copy constructor
-        unique_ptr(const unique_ptr&) = delete;
-        // Disable copy assignment
-        unique_ptr& operator=(const unique_ptr&) = delete;
-
-    private:
-        Ptr<T, D> _impl;
+        refcount_stats* _stats = &refcount_stats::of<void>(); // blocks that do not call _track
+        const void* _owner = nullptr;
+#endif
+        typename C::type _use_count{ 1 };
+        // Note: _weak_use_count = #weak_ptrs + (#shared_ptr > 0) ? 1 : 0
+        typename _W::type _weak_use_count{ 1 };
     };
 
-    // unique_ptr for array objects with a runtime length
-    template <typename T, typename D>
-    class unique_ptr<T[], D> {
+    // Control block for reference counting of shared_ptr and weak_ptr.
+    // Allocated with new, see control_block_alloc for custom allocator support.
+    template<typename T, typename D = default_delete<T>, typename C = atomic_counter>
+    class control_block : public control_block_base<C> {
     public:
-        using pointer = T*;
-        using deleter_type = D;
+        control_block(T* p) : _impl{ p } { this->template _track<T>(); }
+        control_block(T* p, D d) : _impl{ p, std::move(d) } { this->template _track<T>(); }
+        ~control_block() { }
 
-        // Default ctor, creates a unique_ptr that owns nothing
-        constexpr unique_ptr() noexcept = default;
-        // Construct with nullptr, creates a unique_ptr that owns nothing
-        constexpr unique_ptr(std::nullptr_t) noexcept { }
-        // Take ownership from a pointer
-        explicit unique_ptr(T* p) noexcept : _impl{ p } { }
-        // Take ownership from a pointer, supplied with a custom deleter
-        // d: a reference to a deleter.
-        unique_ptr(T* p, typename std::conditional<std::is_reference<deleter_type>::value, deleter_type, const deleter_type&>::type d) noexcept : _impl{ p, d } { }
-        // Take ownership from a pointer, supplied with a custom deleter
-        // d: an rvalue reference to a deleter.
-        // Not permitted if deleter_type is an lvalue reference.
-        unique_ptr(T* p, typename std::remove_reference<deleter_type>::type&& d) noexcept : _impl{ p, std::move(d) } 
-        { static_assert(!std::is_reference<deleter_type>::value, "rvalue deleter bound to reference"); }
-        // Move ctor: takes ownership from a unique_ptr of the same type
-        unique_ptr(unique_ptr&& up) noexcept : _impl{ up.release(), up.get_deleter() } { }
-        // Invoke deleter if the stored pointer is not null
-        ~unique_ptr() noexcept {
+        // Type erasure for storing deleter
+        void* get_deleter() noexcept override { return reinterpret_cast<void*>(std::addressof(_impl._impl_deleter())); }
+
+    protected:
+        void dispose() noexcept override {
             auto _ptr = _impl._impl_ptr();
             auto& _deleter = _impl._impl_deleter();
             if (_ptr)
-                _deleter(_ptr);
+                _deleter(_ptr); // destroy the object _ptr points to
         }
-        // Move assignment: takes ownership from a unique_ptr of the same type
-        unique_ptr& operator= (unique_ptr&& up) noexcept {
-            reset(up.release());
-            auto& _deleter = _impl._impl_deleter();
-            _deleter = up.get_deleter();
-            return *this;
+
+        void destroy() noexcept override { delete this; }
+
+    private:
+        Ptr<T, D> _impl;
+    };
+
+    // Control block that holds the managed object inline, right after the reference counters.
+    // Used by make_shared, so the object and the counters share one allocation and one cache line.
+    template<typename T, typename C = atomic_counter>
+    class control_block_inplace : public control_block_base<C> {
+    public:
+        template<typename... Args>
+        explicit control_block_inplace(Args&&... args) {
+            ::new (static_cast<void*>(&_storage)) T{ std::forward<Args>(args)... };
+            this->template _track<T>();
         }
-        // Reset unique_ptr to empty if assigned to nullptr 
-        unique_ptr& operator=(std::nullptr_t) noexcept {
-            reset();
-            return *this;
+        // Tag to default-initialize the inline object, see make_shared_for_overwrite
+        struct default_init { };
+        explicit control_block_inplace(default_init) {
+            ::new (static_cast<void*>(&_storage)) T;
+            this->template _track<T>();
+        }
+        ~control_block_inplace() { }
+
+        // No deleter is stored, the object is destroyed in place
+        void* get_deleter() noexcept override { return nullptr; }
+
+        // Get the address of the inline object
+        T* get() noexcept { return reinterpret_cast<T*>(&_storage); }
+
+    protected:
+        // Tag for derived blocks that construct the inline object themselves
+        struct no_init { };
+        explicit control_block_inplace(no_init) noexcept { this->template _track<T>(); }
+
+        // Destroy the object in place, storage is released with the block
+        void dispose() noexcept override { get()->~T(); }
+
+        void destroy() noexcept override { delete this; }
+
+    private:
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type _storage;
+    };
+
+    // Smallest distance between two objects that avoids false sharing, see SP_CACHE_LINE_SIZE.
+    constexpr std::size_t cache_line_size = SP_CACHE_LINE_SIZE;
+
+    // Control block like control_block_inplace, with the object on the cache lines after the counters,
+    // so copies and releases on other threads do not invalidate its fields. Used by make_shared_padded.
+    template<typename T, typename C = atomic_counter>
+    class control_block_inplace_padded : public control_block_base<C> {
+    public:
+        template<typename... Args>
+        explicit control_block_inplace_padded(Args&&... args) {
+            ::new (static_cast<void*>(_storage)) T{ std::forward<Args>(args)... };
+            this->template _track<T>();
+        }
+        ~control_block_inplace_padded() { }
+
+        // No deleter is stored, the object is destroyed in place
+        void* get_deleter() noexcept override { return nullptr; }
+
+        // Get the address of the inline object
+        T* get() noexcept { return reinterpret_cast<T*>(_storage); }
+
+    protected:
+        // Destroy the object in place, storage is released with the block
+        void dispose() noexcept override { get()->~T(); }
+
+        void destroy() noexcept override { delete this; }
+
+    private:
+        alignas(cache_line_size) alignas(T) unsigned char _storage[(sizeof(T) + cache_line_size - 1) / cache_line_size * cache_line_size];
+    };
+
+    // Allocate and construct a control block through a copy of allocator a, rebound to the block type.
+    template<typename CB, typename A, typename... Args>
+    inline CB* allocate_control_block(const A& a, Args&&... args) {
+        using _Alloc = typename std::allocator_traits<A>::template rebind_alloc<CB>;
+        using _Traits = std::allocator_traits<_Alloc>;
+        _Alloc _a{ a };
+        CB* cb = _Traits::allocate(_a, 1);
+        try {
+            ::new (static_cast<void*>(cb)) CB{ std::forward<Args>(args)... };
+        }
+        catch (...) {
+            _Traits::deallocate(_a, cb, 1);
+            throw;
+        }
+        return cb;
+    }
+
+    // Destroy and deallocate a control block through a copy of allocator a, rebound to the block type.
+    template<typename CB, typename A>
+    inline void deallocate_control_block(const A& a, CB* cb) noexcept {
+        using _Alloc = typename std::allocator_traits<A>::template rebind_alloc<CB>;
+        using _Traits = std::allocator_traits<_Alloc>;
+        _Alloc _a{ a };
+        cb->~CB();
+        _Traits::deallocate(_a, cb, 1);
+    }
+
+    // Allocator of a control block, an empty base for stateless allocators so it takes no space.
+    template<typename A, bool = std::is_empty<A>::value && !std::is_final<A>::value>
+    class _Alloc_holder {
+    public:
+        explicit _Alloc_holder(const A& a) : _a{ a } { }
+        A& _alloc() noexcept { return _a; }
+
+    private:
+        A _a;
+    };
+    template<typename A>
+    class _Alloc_holder<A, true> : private A {
+    public:
+        explicit _Alloc_holder(const A& a) : A{ a } { }
+        A& _alloc() noexcept { return *this; }
+    };
+
+    // Control block with a custom deleter, allocated and deallocated through allocator A.
+    template<typename T, typename D, typename A, typename C = atomic_counter>
+    class control_block_alloc : public control_block<T, D, C>, private _Alloc_holder<A> {
+    public:
+        control_block_alloc(T* p, D d, const A& a) : control_block<T, D, C>{ p, std::move(d) }, _Alloc_holder<A>{ a } { }
+        ~control_block_alloc() { }
+
+    protected:
+        void destroy() noexcept override {
+            A a{ std::move(this->_alloc()) };
+            deallocate_control_block(a, this); // destroy control_block through the allocator
+        }
+    };
+
+    // Control block holding the managed object inline, the object and the block are
+    // constructed, destroyed and deallocated through allocator A. Used by allocate_shared.
+    template<typename T, typename A, typename C = atomic_counter>
+    class control_block_inplace_alloc : public control_block_inplace<T, C>, private _Alloc_holder<A> {
+        using _Base = control_block_inplace<T, C>;
+        using _Obj_alloc = typename std::allocator_traits<A>::template rebind_alloc<typename std::remove_cv<T>::type>;
+        using _Obj_traits = std::allocator_traits<_Obj_alloc>;
+
+    public:
+        template<typename... Args>
+        explicit control_block_inplace_alloc(const A& a, Args&&... args) : _Base{ typename _Base::no_init{} }, _Alloc_holder<A>{ a } {
+            _Obj_alloc _a{ this->_alloc() };
+            _Obj_traits::construct(_a, _object(), std::forward<Args>(args)...);
+        }
+        ~control_block_inplace_alloc() { }
+
+    protected:
+        void dispose() noexcept override {
+            _Obj_alloc _a{ this->_alloc() };
+            _Obj_traits::destroy(_a, _object()); // destroy the object through the allocator
+        }
+
+        void destroy() noexcept override {
+            A a{ std::move(this->_alloc()) };
+            deallocate_control_block(a, this); // destroy control_block and object storage through the allocator
+        }
+
+    private:
+        typename std::remove_cv<T>::type* _object() noexcept { return const_cast<typename std::remove_cv<T>::type*>(this->get()); }
+    };
+
+    // Control block followed by n elements of type E in the same allocation, used by make_shared
+    // for arrays. The elements start at the first multiple of their alignment past the counters,
+    // so the counters and the first elements share a cache line unless a larger alignment is requested.
+    template<typename E, typename C = atomic_counter>
+    class control_block_array : public control_block_base<C> {
+    public:
+        // How the elements are initialized: value-initialized, copies of a pattern, or default-initialized
+        enum class init { value, fill, none };
+
+        // Allocate a block holding n elements aligned to at least align (a power of 2).
+        // For init::fill element i is a copy of u[i % u_size].
+        static control_block_array* create(std::size_t n, std::size_t align, init how, const E* u = nullptr, std::size_t u_size = 1) {
+            assert((align & (align - 1)) == 0);
+            if (align < alignof(E))
+                align = alignof(E);
+            if (align < alignof(control_block_array))
+                align = alignof(control_block_array);
+            std::size_t offset = _offset(align);
+            if (n > (static_cast<std::size_t>(-1) - offset) / sizeof(E))
+                throw std::bad_array_new_length{};
+            void* mem = _allocate(offset + n * sizeof(E), align);
+            auto* cb = ::new (mem) control_block_array{ n, align };
+            E* p = cb->get();
+            std::size_t i = 0;
+            try {
+                for (; i < n; ++i) {
+                    if (how == init::value)
+                        ::new (static_cast<void*>(p + i)) E();
+                    else if (how == init::fill)
+                        ::new (static_cast<void*>(p + i)) E(u[i % u_size]);
+                    else
+                        ::new (static_cast<void*>(p + i)) E;
+                }
+            }
+            catch (...) {
+                while (i > 0)
+                    p[--i].~E();
+                cb->~control_block_array();
+                _deallocate(mem, align);
+                throw;
+            }
+            return cb;
+        }
+
+        // No deleter is stored, the elements are destroyed in place
+        void* get_deleter() noexcept override { return nullptr; }
+
+        // Get the address of the first element
+        E* get() noexcept { return reinterpret_cast<E*>(reinterpret_cast<unsigned char*>(this) + _offset(_align)); }
+
+    protected:
+        // Destroy the elements in reverse order, storage is released with the block
+        void dispose() noexcept override {
+            E* p = get();
+            for (std::size_t i = _size; i > 0; --i)
+                p[i - 1].~E();
+        }
+
+        void destroy() noexcept override {
+            std::size_t align = _align;
+            this->~control_block_array();
+            _deallocate(this, align);
+        }
+
+    private:
+        control_block_array(std::size_t n, std::size_t align) noexcept : _size{ n }, _align{ align } { this->template _track<E[]>(); }
+        ~control_block_array() { }
+
+        static std::size_t _offset(std::size_t align) noexcept { return (sizeof(control_block_array) + align - 1) & ~(align - 1); }
+
+        static void* _allocate(std::size_t bytes, std::size_t align) {
+            if (align > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+                return ::operator new(bytes, std::align_val_t{ align });
+            return ::operator new(bytes);
+        }
+
+        static void _deallocate(void* p, std::size_t align) noexcept {
+            if (align > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+                ::operator delete(p, std::align_val_t{ align });
+            else
+                ::operator delete(p);
+        }
+
+        std::size_t _size;
+        std::size_t _align;
+    };
+
+    // Thread-caching free list of blocks of one size class, used to recycle control blocks. Each thread
+    // reuses up to _max_cached freed blocks without locking. Tag separates users that must not share blocks.
+    template<std::size_t Size, typename Tag = void>
+    class block_pool {
+    public:
+        static void* allocate() {
+            if (void* p = try_allocate())
+                return p;
+            return ::operator new(Size);
+        }
+
+        // Take a block from this thread's list, nullptr if it is empty.
+        static void* try_allocate() noexcept {
+            _cache_t& c = _cache();
+            if (_node* n = c.head) {
+                c.head = n->next;
+                --c.count;
+                return n;
+            }
+            return nullptr;
+        }
+
+        // Return true if the block was kept for reuse, false if it went back to operator delete.
+        static bool deallocate(void* p) noexcept {
+            _cache_t& c = _cache();
+            if (c.closed || c.count == _max_cached) {
+                ::operator delete(p);
+                return false;
+            }
+            static thread_local _drain_t _drain; // frees the cached blocks at thread exit
+            (void)_drain;
+            c.head = ::new (p) _node{ c.head };
+            ++c.count;
+            return true;
+        }
+
+    private:
+        static constexpr std::size_t _max_cached = 256;
+
+        struct _node { _node* next; };
+        // Trivially destructible, so it stays usable by destructors running after _drain at thread exit.
+        struct _cache_t {
+            _node* head;
+            std::size_t count;
+            bool closed;
+        };
+        struct _drain_t {
+            ~_drain_t() {
+                _cache_t& c = _cache();
+                c.closed = true;
+                while (_node* n = c.head) {
+                    c.head = n->next;
+                    ::operator delete(n);
+                }
+                if constexpr (!std::is_void<Tag>::value)
+                    Tag::_drained(c.count); // let the owner account for the freed blocks
+                c.count = 0;
+            }
+        };
+
+        static _cache_t& _cache() noexcept {
+            static thread_local _cache_t c{ nullptr, 0, false };
+            return c;
+        }
+    };
+
+    // Allocator recycling single objects through the block_pool of their size class,
+    // arrays and over-aligned types go to operator new.
+    template<typename T>
+    class pool_allocator {
+        static constexpr std::size_t _size_class = (sizeof(T) + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t);
+        static constexpr bool _pooled = alignof(T) <= alignof(std::max_align_t);
+
+    public:
+        using value_type = T;
+
+        constexpr pool_allocator() noexcept = default;
+        template<typename U>
+        constexpr pool_allocator(const pool_allocator<U>&) noexcept { }
+
+        T* allocate(std::size_t n) {
+            if (_pooled && n == 1)
+                return static_cast<T*>(block_pool<_size_class>::allocate());
+            return std::allocator<T>{}.allocate(n);
+        }
+
+        void deallocate(T* p, std::size_t n) noexcept {
+            if (_pooled && n == 1)
+                block_pool<_size_class>::deallocate(p);
+            else
+                std::allocator<T>{}.deallocate(p, n);
+        }
+    };
+
+    template<typename T, typename U>
+    inline bool operator==(const pool_allocator<T>&, const pool_allocator<U>&) noexcept { return true; }
+    template<typename T, typename U>
+    inline bool operator!=(const pool_allocator<T>&, const pool_allocator<U>&) noexcept { return false; }
+
+    // Control block for a raw pointer with a small custom deleter, kept in an inline buffer behind a
+    // two-entry operation table: all such deleters share this block type and its 64 byte size class.
+    // Pooled selects allocation from pool_allocator, see use_control_block_pool.
+    template<typename C = atomic_counter, bool Pooled = false>
+    class control_block_sbo : public control_block_base<C> {
+    public:
+        static constexpr std::size_t buffer_size = 3 * sizeof(void*);
+
+        // Whether a deleter of type D is stored inline
+        template<typename D>
+        static constexpr bool fits = sizeof(D) <= buffer_size && alignof(D) <= alignof(void*)
+            && std::is_nothrow_move_constructible<D>::value;
+
+        template<typename T, typename Del, typename D = typename std::decay<Del>::type>
+        control_block_sbo(T* p, Del&& d) noexcept(std::is_nothrow_constructible<D, Del&&>::value) : _ptr{ const_cast<void*>(static_cast<const volatile void*>(p)) }, _ops{ &_ops_for<T, D>::table } {
+            static_assert(fits<D>, "deleter does not fit the inline buffer");
+            ::new (static_cast<void*>(_buffer)) D{ std::forward<Del>(d) };
+            this->template _track<T>();
+        }
+        ~control_block_sbo() { }
+
+        // Type erasure for storing deleter
+        void* get_deleter() noexcept override { return _buffer; }
+
+    protected:
+        void dispose() noexcept override {
+            if (_ptr)
+                _ops->invoke(_buffer, _ptr); // destroy the object _ptr points to
+        }
+
+        void destroy() noexcept override {
+            _ops->destroy(_buffer);
+            if constexpr (Pooled)
+                deallocate_control_block(pool_allocator<control_block_sbo>{}, this);
+            else
+                delete this;
+        }
+
+    private:
+        struct _ops_t {
+            void (*invoke)(void* d, void* p) noexcept;
+            void (*destroy)(void* d) noexcept;
+        };
+
+        template<typename T, typename D>
+        struct _ops_for {
+            static void invoke(void* d, void* p) noexcept { (*static_cast<D*>(d))(static_cast<T*>(p)); }
+            static void destroy(void* d) noexcept { static_cast<D*>(d)->~D(); }
+            static constexpr _ops_t table{ &invoke, &destroy };
+        };
+
+        void* _ptr;
+        const _ops_t* _ops;
+        alignas(void*) unsigned char _buffer[buffer_size];
+    };
+
+    // Opt-in: control blocks of shared_ptr built from a raw pointer to T come from pool_allocator.
+    // Enable for all types with SP_POOL_CONTROL_BLOCKS, or for one type by specializing this trait.
+    template<typename T>
+    struct use_control_block_pool : std::integral_constant<bool, SP_POOL_CONTROL_BLOCKS != 0> { };
+
+    template<typename D>
+    struct _Is_default_delete : std::false_type { };
+    template<typename T>
+    struct _Is_default_delete<default_delete<T>> : std::true_type { };
+
+    // Create the control block for p with deleter d, pooled if enabled for T.
+    // default_delete is called directly from control_block, other small deleters go inline in control_block_sbo.
+    // d is only moved from once the block is allocated, so a failure leaves d and p alone.
+    template<typename T, typename D, typename C, typename Del>
+    inline control_block_base<C>* _make_control_block(T* p, Del&& d) {
+        constexpr bool _pooled = use_control_block_pool<T>::value;
+        if constexpr (!_Is_default_delete<D>::value && control_block_sbo<C, _pooled>::template fits<D>
+                      && std::is_nothrow_constructible<D, Del&&>::value) {
+            if constexpr (_pooled)
+                return allocate_control_block<control_block_sbo<C, true>>(pool_allocator<char>{}, p, std::forward<Del>(d));
+            else
+                return new control_block_sbo<C>{ p, std::forward<Del>(d) };
+        }
+        else if constexpr (_pooled)
+            return allocate_control_block<control_block_alloc<T, D, pool_allocator<T>, C>>(pool_allocator<T>{}, p, std::forward<Del>(d), pool_allocator<T>{});
+        else
+            return new control_block<T, D, C>{ p, std::forward<Del>(d) };
+    }
+
+    // Create the control block for a raw pointer p with deleter d. If that throws, d(p) is called.
+    template<typename T, typename D, typename C, typename Del>
+    inline control_block_base<C>* new_control_block(T* p, Del&& d) {
+        try {
+            return _make_control_block<T, D, C>(p, std::forward<Del>(d));
+        }
+        catch (...) {
+            d(p);
+            throw;
+        }
+    }
+    // As above, with the block allocated through a. If that throws, d(p) is called.
+    template<typename T, typename D, typename C, typename A>
+    inline control_block_base<C>* new_control_block(T* p, D& d, const A& a) {
+        try {
+            return allocate_control_block<control_block_alloc<T, D, A, C>>(a, p, std::move(d), a); // d is moved once allocated
+        }
+        catch (...) {
+            d(p);
+            throw;
+        }
+    }
+
+    // Type exception thrown by ctors of shared_ptr with weak_ptr as argument, when weak_ptr refers to already deleted object.
+    class bad_weak_ptr : public std::exception {
+    public:
+        const char* what() const noexcept override { return "weak_ptr is expired!"; }
+    };
+
+    // Forward declaration
+    template<typename T, typename C = atomic_counter> class shared_ptr;
+
+    // weak_ptr implementation
+    // C is the reference counter policy of the shared_ptr it observes.
+    template <typename T, typename C = atomic_counter>
+    class SP_TRIVIALLY_RELOCATABLE weak_ptr {
+    public:
+        template<typename U, typename E> friend class shared_ptr;
+        template<typename U, typename E> friend class weak_ptr;
+
+        using element_type = typename std::remove_extent<T>::type;
+
+        // Default ctor, creates an empty weak_ptr.
+        // Postconditions: use_count() == 0.
+        constexpr weak_ptr() noexcept : _ptr{}, _control_block{} { }
+        // Conversion ctor: shares ownership with sp.
+        // Postconditions: use_count() == sp.use_count().
+        template<class U>
+        weak_ptr(shared_ptr<U, C> const& sp) noexcept : _ptr{ sp._ptr }, _control_block{ sp._control_block }
+        { if (_control_block) _control_block->inc_wref(); }
+        // Copy ctor: shares ownership with wp.
+        // Postconditions: use_count() == wp.use_count().
+        weak_ptr(weak_ptr const& wp) noexcept : _ptr{ wp._ptr }, _control_block{ wp._control_block }
+        { if (_control_block) _control_block->inc_wref(); }
+        // Copy ctor: shares ownership with wp.
+        // Postconditions: use_count() == wp.use_count().
+        template<class U>
+        weak_ptr(weak_ptr<U, C> const& wp) noexcept : _ptr{ wp._ptr }, _control_block{ wp._control_block }
+        { if (_control_block) _control_block->inc_wref(); }
+        ~weak_ptr() { if (_control_block) _control_block->dec_wref(); }
+        weak_ptr& operator=(const weak_ptr& wp) noexcept {
+            weak_ptr{ wp }.swap(*this);
+            return *this;
+        }
+        template<typename U>
+        weak_ptr& operator=(const weak_ptr<U, C>& wp) noexcept {
+            weak_ptr{ wp }.swap(*this);
+            return *this;
+        }
+        template<typename U>
+        weak_ptr& operator=(const shared_ptr<U, C>& sp) noexcept {
+            weak_ptr{ sp }.swap(*this);
+            return *this;
+        }
+
+        // Exchange contents of *this and sp.
+        void swap(weak_ptr& wp) noexcept {
+            using std::swap;
+            swap(_ptr, wp._ptr);
+            swap(_control_block, wp._control_block);
+        }
+
+        // Reset *this to empty.
+        void reset() noexcept { weak_ptr{}.swap(*this); }
+
+        // Get use_count
+        long use_count() const noexcept { return (_control_block) ? _control_block->use_count() : 0; }
+
+        // Check if use_count == 0
+        bool expired() const noexcept { return (_control_block) ? _control_block->expired() : true; }
+
+        // Get a shared_ptr to the managed object, empty if it expired.
+        // Single compare-exchange on use_count, which cannot race with the last shared_ptr going away.
+        shared_ptr<T, C> lock() const noexcept {
+            return (_control_block && _control_block->inc_ref_nz()) ? shared_ptr<T, C>{ _ptr, _control_block } : shared_ptr<T, C>{};
+        }
+
+        // Check whether this shared_ptr precedes other in owner-based order
+        // Implemented by comparing the address of control_block
+        template<typename U>
+        bool owner_before(shared_ptr<U, C> const& sp) const
+        {
+            return std::less<control_block_base<C>*>()(_control_block, sp._control_block);
+        }
+        // Check whether this shared_ptr precedes other in owner-based order
+        // Implemented by comparing the address of control_block
+        template<class U>
+        bool owner_before(weak_ptr<U, C> const& wp) const
+        {
+            return std::less<control_block_base<C>*>()(_control_block, wp._control_block);
+        }
+
+        // Hash of the owner, consistent with owner_equal. Added in C++26.
+        std::size_t owner_hash() const noexcept { return std::hash<const void*>()(_control_block); }
+
+        // Check if both share ownership or are both empty. Added in C++26.
+        template<typename U>
+        bool owner_equal(shared_ptr<U, C> const& sp) const noexcept { return _control_block == sp._control_block; }
+        template<typename U>
+        bool owner_equal(weak_ptr<U, C> const& wp) const noexcept { return _control_block == wp._control_block; }
+
+    private:
+        element_type* _ptr;
+        control_block_base<C>* _control_block;
+    };
+
+    // Swap with another weak_ptr
+    template<typename T, typename C>
+    inline void swap(weak_ptr<T, C>& wp1, weak_ptr<T, C>& wp2) { wp1.swap(wp2); }
+
+    // Forward declarations.
+    template<typename T, typename D> class unique_ptr;
+    template<typename T, typename C> class shared_ptr;
+    template<typename T, typename C> class weak_ptr;
+    template<typename T, typename C = atomic_counter> class enable_shared_from_this;
+
+    // Define operator*, operator-> and operator[] for T not array or cv void
+    template<typename T, typename C, bool = std::is_array<T>::value, bool = std::is_void<T>::value>
+    class shared_ptr_access {
+    public:
+        using element_type = T;
+
+        // Dereference pointer to the managed object
+        T& operator*() const noexcept { assert(_get() != nullptr); return *_get(); }
+        T* operator->() const noexcept { assert(_get() != nullptr); return _get(); }
+
+    private:
+        T* _get() const noexcept { return static_cast<const shared_ptr<T, C>*>(this)->get(); }
+    };
+
+    // Specialization of shared_ptr_access for T array type. Defines operator[] for shared_ptr<T[]> and shared_ptr<T[N]>
+    template<typename T, typename C>
+    class shared_ptr_access<T, C, true, false> {
+    public:
+        using element_type = typename std::remove_extent<T>::type;
+
+        // Index operator, dereferencing operators are not provided.
+        element_type& operator[](std::ptrdiff_t i) const noexcept
+        {
+            assert(_get() != nullptr);
+            assert(i >= 0 && (!std::extent<T>::value || static_cast<std::size_t>(i) < std::extent<T>::value));
+            return _get()[i];
+        }
+
+    private:
+        element_type* _get() const noexcept { return static_cast<const shared_ptr<T, C>*>(this)->get(); }
+    };
+
+    // Specialization of shared_ptr_access for T cv void type. Defines operator-> for shared_ptr<cv void>
+    template<typename T, typename C>
+    class shared_ptr_access<T, C, false, true> {
+    public:
+        using element_type = T;
+
+        // Dereference pointer to the managed object, operator* is not provided
+        T* operator->() const noexcept { assert(_get() != nullptr); return _get(); }
+
+    private:
+        T* _get() const noexcept { return static_cast<const shared_ptr<T, C>*>(this)->get(); }
+    };
+
+    // Default deleter of a U* owned by shared_ptr<T>, delete[] if T is an array type
+    template<typename T, typename U>
+    struct _Shared_delete { using type = default_delete<U>; };
+    template<typename T, typename U>
+    struct _Shared_delete<T[], U> { using type = default_delete<U[]>; };
+    template<typename T, std::size_t N, typename U>
+    struct _Shared_delete<T[N], U> { using type = default_delete<U[]>; };
+
+    // shared_ptr implementation.
+    // C is the reference counter policy: atomic_counter (default) or local_counter, see local_shared_ptr.
+    template<typename T, typename C>
+    class SP_TRIVIALLY_RELOCATABLE shared_ptr : public shared_ptr_access<T, C> {
+    public:
+        template<typename U, typename E> friend class shared_ptr;
+        template<typename U, typename E> friend class weak_ptr;
+        template<typename D, typename U, typename E> friend D* get_deleter(const shared_ptr<U, E>&) noexcept;
+        template<typename U, typename E> friend shared_ptr<U, E> _adopt_shared(typename shared_ptr<U, E>::element_type*, control_block_base<E>*) noexcept;
+        template<typename U, typename E> friend shared_ptr<U, E> _adopt_new_shared(typename shared_ptr<U, E>::element_type*, control_block_base<E>*) noexcept;
+        template<typename U, typename E> friend control_block_base<E>* _shared_control_block(const shared_ptr<U, E>&) noexcept;
+        template<typename U, typename E> friend control_block_base<E>* _detach_shared(shared_ptr<U, E>&) noexcept;
+        template<typename U> friend class atomic_shared_ptr;
+
+        using element_type = typename shared_ptr_access<T, C>::element_type;
+        using weak_type = weak_ptr<T, C>; /* added in C++17 */
+        using counter_type = C;
+
+        // Default ctor, creates a shared_ptr with no managed object
+        // Postconditions: use_count() == 0 && get() == 0.
+        constexpr shared_ptr() noexcept : _ptr{}, _control_block{} { }
+        // Construct a shared_ptr with no managed object
+        // Postconditions: use_count() == 0 && get() == 0.
+        constexpr shared_ptr(std::nullptr_t) noexcept : _ptr{}, _control_block{} { }
+        // Construct a shared_ptr with p as the pointer to the managed object
+        // Postconditions: use_count() == 1 && get() == p. 
+        // Arrays are deleted with delete[].
+        template<typename U>
+        explicit shared_ptr(U* p) : _ptr{ p }, _control_block{ new_control_block<U, typename _Shared_delete<T, U>::type, C>(p, typename _Shared_delete<T, U>::type{}) } { _enable_weak_this(p); }
+        // Construct a shared_ptr with p as the pointer to the managed object, supplied with custom deleter
+        // Postconditions: use_count() == 1 && get() == p.
+        template<typename U, typename D>
+        shared_ptr(U* p, D d) : _ptr{ p }, _control_block{ new_control_block<U, D, C>(p, std::move(d)) } { _enable_weak_this(p); }
+        // Construct a shared_ptr with p as the pointer to the managed object, supplied with custom deleter and allocator
+        // Postconditions: use_count() == 1 && get() == p.
+        template<typename U, typename D, typename A>
+        shared_ptr(U* p, D d, A a) : _ptr{ p }, _control_block{ new_control_block<U, D, C>(p, d, a) } { _enable_weak_this(p); }
+        // Construct a shared_ptr with no managed object, supplied with custom deleter
+        // Postconditions: use_count() == 1 && get() == 0.
+        template<typename D>
+        shared_ptr(std::nullptr_t p, D d) : _ptr{ nullptr }, _control_block{ new_control_block<T, D, C>(p, std::move(d)) } { }
+        // Construct a shared_ptr with no managed object, supplied with custom deleter and allocator
+        // Postconditions: use_count() == 1 && get() == 0.
+        template<typename D, typename A>
+        shared_ptr(std::nullptr_t p, D d, A a) : _ptr{ nullptr }, _control_block{ new_control_block<T, D, C>(p, d, a) } { }
+        // Aliasing ctor: constructs a shared_ptr instance that stores p and shares ownership with sp
+        // Postconditions: use_count() == sp.use_count() && get() == p.
+        template<typename U>
+        shared_ptr(const shared_ptr<U, C>& sp, element_type* p) noexcept : _ptr{ p }, _control_block{ sp._control_block }
+        { if (_control_block) _control_block->inc_ref(); }
+        // Moving aliasing ctor: as above, but takes over the reference of sp instead of adding one. Added in C++20.
+        // Postconditions: get() == p, sp is empty.
+        template<typename U>
+        shared_ptr(shared_ptr<U, C>&& sp, element_type* p) noexcept : _ptr{ p }, _control_block{ sp._control_block }
+        { sp._ptr = nullptr; sp._control_block = nullptr; }
+        // Copy ctor: shares ownership of the object managed by sp
+        // Postconditions: use_count() == sp.use_count() && get() == sp.get().
+        shared_ptr(const shared_ptr& sp) noexcept : _ptr{ sp._ptr }, _control_block{ sp._control_block }
+        { if (_control_block) _control_block->inc_ref(); }
+        // Copy ctor: shares ownership of the object managed by sp
+        // Postconditions: use_count() == sp.use_count() && get() == sp.get().
+        template<typename U>
+        shared_ptr(const shared_ptr<U, C>& sp) noexcept : _ptr{ sp._ptr }, _control_block{ sp._control_block }
+        { if (_control_block) _control_block->inc_ref(); }
+        // Move ctor: Move-constructs a shared_ptr from sp
+        // Postconditions: *this shall contain the old value of sp.
+        // sp shall be empty. sp.get() == 0.
+        shared_ptr(shared_ptr&& sp) noexcept : _ptr{ std::move(sp._ptr) }, _control_block{ std::move(sp._control_block) } {
+            sp._ptr = nullptr;
+            sp._control_block = nullptr;
+        }
+        // Move ctor: Move-constructs a shared_ptr from sp
+        // Postconditions: *this shall contain the old value of sp.
+        //     sp shall be empty. sp.get() == 0.
+        template<typename U>
+        shared_ptr(shared_ptr<U, C>&& sp) noexcept : _ptr{ sp._ptr }, _control_block{ sp._control_block } {
+            sp._ptr = nullptr;
+            sp._control_block = nullptr;
+        }
+        // Constructsa shared_ptr object that shares ownership with wp
+        // Postconditions: use_count() == wp.use_count().
+        template<typename U>
+        explicit shared_ptr(const weak_ptr<U, C>& wp) : _ptr{ wp._ptr }, _control_block{ wp._control_block } {
+            if (!_control_block || !_control_block->inc_ref_nz())
+                throw bad_weak_ptr{};
+        }
+        // Construct a shared_ptr object that obtains ownership from up
+        // Postconditions: use_count() == 1. up shall be empty. up.get() = 0.
+        // up keeps ownership if the allocation throws.
+        template<typename U, typename D>
+        shared_ptr(unique_ptr<U, D>&& up) : _ptr{ up.get() }, _control_block{ _unique_control_block(up) } {
+            _enable_weak_this(up.get());
+            up.release();
+        }
+        ~shared_ptr() { if (_control_block) _control_block->dec_ref(); }
+        // Copy assignment
+        shared_ptr& operator=(const shared_ptr& sp) noexcept {
+            shared_ptr{ sp }.swap(*this);
+            return *this;
+        }
+        template<typename U>
+        shared_ptr& operator=(const shared_ptr<U, C>& sp) noexcept {
+            shared_ptr{ sp }.swap(*this);
+            return *this;
+        }
+        // Move assignment
+        shared_ptr& operator=(shared_ptr&& sp) noexcept {
+            shared_ptr{ std::move(sp) }.swap(*this);
+            return *this;
+        }
+        template<typename U>
+        shared_ptr& operator=(shared_ptr<U, C>&& sp) noexcept {
+            shared_ptr{ std::move(sp) }.swap(*this);
+            return *this;
+        }
+        // Move assignment from a unique_ptr
+        template<typename U, typename D>
+        shared_ptr& operator=(unique_ptr<U, D>&& up) {
+            shared_ptr{ std::move(up) }.swap(*this);
+            return *this;
+        }
+
+        // Exchange the contents of *this and sp
+        void swap(shared_ptr& sp) noexcept {
+            using std::swap;
+            swap(_ptr, sp._ptr);
+            swap(_control_block, sp._control_block);
+        }
+
+        // Reset *this to empty
+        void reset() noexcept { shared_ptr{}.swap(*this); }
+        // Reset *this with p as the pointer to the managed object
+        template<typename U>
+        void reset(U* p) { shared_ptr{ p }.swap(*this); }
+        // Reset *this with p as the pointer to the managed object, supplied with custom deleter
+        template<typename U, typename D>
+        void reset(U* p, D d) { shared_ptr{ p, d }.swap(*this); }
+        // Reset *this with p as the pointer to the managed object, supplied with custom deleter and allocator
+        template<typename U, typename D, typename A>
+        void reset(U* p, D d, A a) { shared_ptr{ p, d, a }.swap(*this); }
+
+        // Get the stored pointer
+        element_type* get() const noexcept { return _ptr; }
+
+        // Get use_count
+        long use_count() const noexcept { return (_control_block) ? _control_block->use_count() : 0; }
+
+        // deprecated in C++17, removed in C++20
+        // Check if use_count == 1
+        bool unique() const noexcept { return (_control_block) ? _control_block->unique() : false; }
+
+        // Check if there is a managed object
+        explicit operator bool() const noexcept { return (_ptr) ? true : false; }
+
+        // Check whether this shared_ptr precedes other in owner-based order
+        // Implemented by comparing the address of control_block
+        template<typename U>
+        bool owner_before(shared_ptr<U, C> const& sp) const {
+            return std::less<control_block_base<C>*>()(_control_block, sp._control_block);
+        }
+
+        // Check whether this shared_ptr precedes other in owner-based order
+        // Implemented by comparing the address of control_block
+        template<class U>
+        bool owner_before(weak_ptr<U, C> const& wp) const {
+            return std::less<control_block_base<C>*>()(_control_block, wp._control_block);
+        }
+
+        // Hash of the owner, consistent with owner_equal. Added in C++26.
+        std::size_t owner_hash() const noexcept { return std::hash<const void*>()(_control_block); }
+
+        // Check if both share ownership or are both empty. Added in C++26.
+        template<typename U>
+        bool owner_equal(shared_ptr<U, C> const& sp) const noexcept { return _control_block == sp._control_block; }
+        template<typename U>
+        bool owner_equal(weak_ptr<U, C> const& wp) const noexcept { return _control_block == wp._control_block; }
+
+    private:
+        // Adopt a control block whose use count already accounts for this shared_ptr
+        shared_ptr(element_type* p, control_block_base<C>* cb) noexcept : _ptr{ p }, _control_block{ cb } { }
+
+        // Point the weak_this of an object deriving from enable_shared_from_this at this new owner,
+        // unless it is already owned: one weak increment, nothing is allocated.
+        template<typename Y>
+        void _enable_weak_this(const enable_shared_from_this<Y, C>* e) noexcept {
+            if (!e)
+                return;
+            auto& w = e->weak_this;
+            if (w._control_block && !w._control_block->expired())
+                return;
+            _control_block->inc_wref();
+            if (w._control_block)
+                w._control_block->dec_wref();
+            w._ptr = const_cast<Y*>(static_cast<const Y*>(e));
+            w._control_block = _control_block;
+        }
+        void _enable_weak_this(...) noexcept { }
+
+        // Control block taking over the object and deleter of up, nullptr if up is empty
+        template<typename U, typename D>
+        static control_block_base<C>* _unique_control_block(unique_ptr<U, D>& up) {
+            using _Elt = typename std::remove_extent<U>::type;
+            if (!up)
+                return nullptr;
+            if constexpr (std::is_reference<D>::value)
+                return _make_control_block<_Elt, std::reference_wrapper<typename std::remove_reference<D>::type>, C>(up.get(), std::ref(up.get_deleter()));
+            else
+                return _make_control_block<_Elt, D, C>(up.get(), std::move(up.get_deleter()));
+        }
+
+        element_type* _ptr;
+        control_block_base<C>* _control_block;
+    };
+
+    // Make a shared_ptr from a control block whose use count already accounts for it.
+    template<typename T, typename C>
+    inline shared_ptr<T, C> _adopt_shared(typename shared_ptr<T, C>::element_type* p, control_block_base<C>* cb) noexcept { return shared_ptr<T, C>{ p, cb }; }
+
+    // As _adopt_shared, for the block of a newly created object: hooks up enable_shared_from_this.
+    template<typename T, typename C>
+    inline shared_ptr<T, C> _adopt_new_shared(typename shared_ptr<T, C>::element_type* p, control_block_base<C>* cb) noexcept {
+        shared_ptr<T, C> sp{ p, cb };
+        sp._enable_weak_this(p);
+        return sp;
+    }
+
+    // shared_ptr and weak_ptr with plain, non-atomic reference counts.
+    // Only for objects that are never shared between threads.
+    template<typename T>
+    using local_shared_ptr = shared_ptr<T, local_counter>;
+    template<typename T>
+    using local_weak_ptr = weak_ptr<T, local_counter>;
+
+    // shared_ptr and weak_ptr with counts biased to the creating thread, see biased_counter.
+    // For objects mostly copied and released by the thread that made them, still safe to share.
+    template<typename T>
+    using biased_shared_ptr = shared_ptr<T, biased_counter>;
+    template<typename T>
+    using biased_weak_ptr = weak_ptr<T, biased_counter>;
+
+    // Create a shared_ptr with counter policy C that manages a new object.
+    // The object is constructed inside its control block, a single allocation.
+    template<typename T, typename C, typename... Args>
+    inline shared_ptr<T, C> basic_make_shared(Args&&... args) {
+        auto* cb = new control_block_inplace<T, C>{ std::forward<Args>(args)... };
+        return _adopt_new_shared<T, C>(cb->get(), cb);
+    }
+
+    // Create a shared_ptr with counter policy C that manages a new object, constructed inside its control block.
+    // The single allocation is made through a copy of a, rebound to the control block type.
+    template<typename T, typename C, typename A, typename... Args>
+    inline shared_ptr<T, C> basic_allocate_shared(const A& a, Args&&... args) {
+        auto* cb = allocate_control_block<control_block_inplace_alloc<T, A, C>>(a, a, std::forward<Args>(args)...);
+        return _adopt_new_shared<T, C>(cb->get(), cb);
+    }
+
+    // make_shared overloads for single objects, arrays with unknown bound and arrays with known bound
+    template<typename T>
+    struct _Shared_if { using _Single_object = shared_ptr<T>; };
+    template<typename T>
+    struct _Shared_if<T[]> { using _Unknown_bound = shared_ptr<T[]>; };
+    template<typename T, std::size_t N>
+    struct _Shared_if<T[N]> { using _Known_bound = shared_ptr<T[N]>; };
+
+    // Create a shared_ptr that manages a new object, see below for arrays.
+    template<typename T, typename... Args>
+    inline typename _Shared_if<T>::_Single_object make_shared(Args&&... args) { return basic_make_shared<T, atomic_counter>(std::forward<Args>(args)...); }
+
+    // Create a shared_ptr that manages a new object, allocated through a.
+    template<typename T, typename A, typename... Args>
+    inline shared_ptr<T> allocate_shared(const A& a, Args&&... args) { return basic_allocate_shared<T, atomic_counter>(a, std::forward<Args>(args)...); }
+
+    // Create a local_shared_ptr that manages a new object.
+    template<typename T, typename... Args>
+    inline local_shared_ptr<T> make_local_shared(Args&&... args) { return basic_make_shared<T, local_counter>(std::forward<Args>(args)...); }
+
+    // Create a local_shared_ptr that manages a new object, allocated through a.
+    template<typename T, typename A, typename... Args>
+    inline local_shared_ptr<T> allocate_local_shared(const A& a, Args&&... args) { return basic_allocate_shared<T, local_counter>(a, std::forward<Args>(args)...); }
+
+    // Create a biased_shared_ptr that manages a new object, owned by the calling thread.
+    template<typename T, typename... Args>
+    inline biased_shared_ptr<T> make_biased_shared(Args&&... args) { return basic_make_shared<T, biased_counter>(std::forward<Args>(args)...); }
+
+    // Create a shared_ptr with counter policy C to n elements of array type T, elements and counters in one allocation.
+    // Nested arrays are stored flattened, u (for init::fill) is one element of T.
+    template<typename T, typename C>
+    inline shared_ptr<T, C> _make_shared_array(std::size_t n, std::size_t align, typename control_block_array<typename std::remove_all_extents<T>::type, C>::init how,
+                                               const typename std::remove_extent<T>::type* u = nullptr) {
+        using _Elt = typename std::remove_extent<T>::type;
+        using _Scalar = typename std::remove_all_extents<T>::type;
+        constexpr std::size_t _inner = sizeof(_Elt) / sizeof(_Scalar);
+        if (n > static_cast<std::size_t>(-1) / _inner)
+            throw std::bad_array_new_length{};
+        auto* cb = control_block_array<_Scalar, C>::create(n * _inner, align, how, reinterpret_cast<const _Scalar*>(u), _inner);
+        return _adopt_shared<T, C>(reinterpret_cast<_Elt*>(cb->get()), cb);
+    }
+
+    template<typename T>
+    using _Array_init = typename control_block_array<typename std::remove_all_extents<T>::type>::init;
+
+    // make_shared_padded: as make_shared, but the object is kept off the cache line of the
+    // reference counters, see control_block_inplace_padded. Costs up to two extra cache lines
+    // per object, worth it for objects read on many threads whose copies contend on the counters.
+    template<typename T, typename... Args>
+    inline typename _Shared_if<T>::_Single_object make_shared_padded(Args&&... args) {
+        auto* cb = new control_block_inplace_padded<T>{ std::forward<Args>(args)... };
+        return _adopt_new_shared<T, atomic_counter>(cb->get(), cb);
+    }
+
+    // Create a shared_ptr to n value-initialized elements.
+    template<typename T>
+    inline typename _Shared_if<T>::_Unknown_bound make_shared(std::size_t n) { return _make_shared_array<T, atomic_counter>(n, 1, _Array_init<T>::value); }
+    // Create a shared_ptr to n elements that are copies of u.
+    template<typename T>
+    inline typename _Shared_if<T>::_Unknown_bound make_shared(std::size_t n, const typename std::remove_extent<T>::type& u) {
+        return _make_shared_array<T, atomic_counter>(n, 1, _Array_init<T>::fill, std::addressof(u));
+    }
+    // Create a shared_ptr to n value-initialized elements, the first one aligned to al.
+    template<typename T>
+    inline typename _Shared_if<T>::_Unknown_bound make_shared(std::size_t n, std::align_val_t al) {
+        return _make_shared_array<T, atomic_counter>(n, static_cast<std::size_t>(al), _Array_init<T>::value);
+    }
+
+    // Create a shared_ptr to N value-initialized elements.
+    template<typename T>
+    inline typename _Shared_if<T>::_Known_bound make_shared() { return _make_shared_array<T, atomic_counter>(std::extent<T>::value, 1, _Array_init<T>::value); }
+    // Create a shared_ptr to N elements that are copies of u.
+    template<typename T>
+    inline typename _Shared_if<T>::_Known_bound make_shared(const typename std::remove_extent<T>::type& u) {
+        return _make_shared_array<T, atomic_counter>(std::extent<T>::value, 1, _Array_init<T>::fill, std::addressof(u));
+    }
+    // Create a shared_ptr to N value-initialized elements, the first one aligned to al.
+    template<typename T>
+    inline typename _Shared_if<T>::_Known_bound make_shared(std::align_val_t al) {
+        return _make_shared_array<T, atomic_counter>(std::extent<T>::value, static_cast<std::size_t>(al), _Array_init<T>::value);
+    }
+
+    // make_shared_for_overwrite: as make_shared, but objects are default-initialized,
+    // trivial types are left uninitialized for the caller to overwrite. Added in C++20.
+    template<typename T>
+    inline typename _Shared_if<T>::_Single_object make_shared_for_overwrite() {
+        auto* cb = new control_block_inplace<T>{ typename control_block_inplace<T>::default_init{} };
+        return _adopt_new_shared<T, atomic_counter>(cb->get(), cb);
+    }
+    template<typename T>
+    inline typename _Shared_if<T>::_Unknown_bound make_shared_for_overwrite(std::size_t n) { return _make_shared_array<T, atomic_counter>(n, 1, _Array_init<T>::none); }
+    template<typename T>
+    inline typename _Shared_if<T>::_Unknown_bound make_shared_for_overwrite(std::size_t n, std::align_val_t al) {
+        return _make_shared_array<T, atomic_counter>(n, static_cast<std::size_t>(al), _Array_init<T>::none);
+    }
+    template<typename T>
+    inline typename _Shared_if<T>::_Known_bound make_shared_for_overwrite() { return _make_shared_array<T, atomic_counter>(std::extent<T>::value, 1, _Array_init<T>::none); }
+    template<typename T>
+    inline typename _Shared_if<T>::_Known_bound make_shared_for_overwrite(std::align_val_t al) {
+        return _make_shared_array<T, atomic_counter>(std::extent<T>::value, static_cast<std::size_t>(al), _Array_init<T>::none);
+    }
+
+    // Operator overloading.
+    template<typename T, typename U, typename C>
+    inline bool operator==(const shared_ptr<T, C>& sp1, const shared_ptr<U, C>& sp2) { return sp1.get() == sp2.get(); }
+    template<typename T, typename C>
+    inline bool operator==(const shared_ptr<T, C>& sp, std::nullptr_t) noexcept { return !sp; }
+    template<typename T, typename C>
+    inline bool operator==(std::nullptr_t, const shared_ptr<T, C>& sp) noexcept { return !sp; }
+
+    template<typename T, typename U, typename C>
+    inline bool operator!=(const shared_ptr<T, C>& sp1, const shared_ptr<U, C>& sp2) { return sp1.get() != sp2.get(); }
+    template<typename T, typename C>
+    inline bool operator!=(const shared_ptr<T, C>& sp, std::nullptr_t) noexcept { return bool{ sp }; }
+    template<typename T, typename C>
+    inline bool operator!=(std::nullptr_t, const shared_ptr<T, C>& sp) noexcept { return bool{ sp }; }
+
+    template<typename T, typename U, typename C>
+    inline bool operator<(const shared_ptr<T, C>& sp1, const shared_ptr<U, C>& sp2) {
+        using _Tp_elt = typename shared_ptr<T, C>::element_type;
+        using _Up_elt = typename shared_ptr<U, C>::element_type;
+        using _CT = typename std::common_type<_Tp_elt*, _Up_elt*>::type;
+        return std::less<_CT>()(sp1.get(), sp2.get());
+    }
+    template<typename T, typename C>
+    inline bool operator<(const shared_ptr<T, C>& sp, std::nullptr_t) {
+        using _Tp_elt = typename shared_ptr<T, C>::element_type;
+        return std::less<_Tp_elt*>()(sp.get(), nullptr);
+    }
+    template<typename T, typename C>
+    inline bool operator<(std::nullptr_t, const shared_ptr<T, C>& sp) {
+        using _Tp_elt = typename shared_ptr<T, C>::element_type;
+        return std::less<_Tp_elt*>()(nullptr, sp.get());
+    }
+
+    template<typename T, typename U, typename C>
+    inline bool operator<=(const shared_ptr<T, C>& sp1, const shared_ptr<U, C>& sp2) { return !(sp2.get() < sp1.get()); }
+    template<typename T, typename C>
+    inline bool operator<=(const shared_ptr<T, C>& sp, std::nullptr_t) { return !(nullptr < sp.get()); }
+    template<typename T, typename C>
+    inline bool operator<=(std::nullptr_t, const shared_ptr<T, C>& sp) { return !(sp.get() < nullptr); }
+
+    template<typename T, typename U, typename C>
+    inline bool operator>(const shared_ptr<T, C>& sp1, const shared_ptr<U, C>& sp2) { return sp2.get() < sp1.get(); }
+    template<typename T, typename C>
+    inline bool operator>(const shared_ptr<T, C>& sp, std::nullptr_t) { return nullptr < sp.get(); }
+    template<typename T, typename C>
+    inline bool operator>(std::nullptr_t, const shared_ptr<T, C>& sp) { return sp.get() < nullptr; }
+
+    template<typename T, typename U, typename C>
+    inline bool operator>=(const shared_ptr<T, C>& sp1, const shared_ptr<U, C>& sp2) { return !(sp1.get() < sp2.get()); }
+    template<typename T, typename C>
+    inline bool operator>=(const shared_ptr<T, C>& sp, std::nullptr_t) { return !(sp.get() < nullptr); }
+    template<typename T, typename C>
+    inline bool operator>=(std::nullptr_t, const shared_ptr<T, C>& sp) { return !(nullptr < sp.get()); }
+
+    // Swap with another shared_ptr.
+    template<typename T, typename C>
+    inline void swap(shared_ptr<T, C>& sp1, shared_ptr<T, C>& sp2) { sp1.swap(sp2); }
+
+    // shared_ptr casts
+    template<typename T, typename U, typename C>
+    inline shared_ptr<T, C> static_pointer_cast(const shared_ptr<U, C>& sp) noexcept {
+        using _Sp = shared_ptr<T, C>;
+        return _Sp(sp, static_cast<typename _Sp::element_type*>(sp.get()));
+    }
+    template<typename T, typename U, typename C>
+    inline shared_ptr<T, C> const_pointer_cast(const shared_ptr<U, C>& sp) noexcept {
+        using _Sp = shared_ptr<T, C>;
+        return _Sp(sp, const_cast<typename _Sp::element_type*>(sp.get()));
+    }
+    template<typename T, typename U, typename C>
+    inline shared_ptr<T, C> dynamic_pointer_cast(const shared_ptr<U, C>& sp) noexcept {
+        using _Sp = shared_ptr<T, C>;
+        if (auto* _p = dynamic_cast<typename _Sp::element_type*>(sp.get()))
+            return _Sp(sp, _p);
+        return _Sp();
+    }
+    // Added in C++17 
+    template<typename T, typename U, typename C>
+    inline shared_ptr<T, C> reinterpret_pointer_cast(const shared_ptr<U, C>& sp) noexcept {
+        using _Sp = shared_ptr<T, C>;
+        return _Sp(sp, reinterpret_cast<typename _Sp::element_type*>(sp.get()));
+    }
+
+    // Moving casts hand the reference over, no reference count traffic. Added in C++20.
+    // A failed dynamic_pointer_cast leaves sp untouched.
+    template<typename T, typename U, typename C>
+    inline shared_ptr<T, C> static_pointer_cast(shared_ptr<U, C>&& sp) noexcept {
+        using _Sp = shared_ptr<T, C>;
+        auto* _p = static_cast<typename _Sp::element_type*>(sp.get());
+        return _Sp(std::move(sp), _p);
+    }
+    template<typename T, typename U, typename C>
+    inline shared_ptr<T, C> const_pointer_cast(shared_ptr<U, C>&& sp) noexcept {
+        using _Sp = shared_ptr<T, C>;
+        auto* _p = const_cast<typename _Sp::element_type*>(sp.get());
+        return _Sp(std::move(sp), _p);
+    }
+    template<typename T, typename U, typename C>
+    inline shared_ptr<T, C> dynamic_pointer_cast(shared_ptr<U, C>&& sp) noexcept {
+        using _Sp = shared_ptr<T, C>;
+        if (auto* _p = dynamic_cast<typename _Sp::element_type*>(sp.get()))
+            return _Sp(std::move(sp), _p);
+        return _Sp();
+    }
+    template<typename T, typename U, typename C>
+    inline shared_ptr<T, C> reinterpret_pointer_cast(shared_ptr<U, C>&& sp) noexcept {
+        using _Sp = shared_ptr<T, C>;
+        auto* _p = reinterpret_cast<typename _Sp::element_type*>(sp.get());
+        return _Sp(std::move(sp), _p);
+    }
+
+    // shared_ptr get_deleter
+    template<typename D, typename T, typename C>
+    inline D* get_deleter(const shared_ptr<T, C>& sp) noexcept { return reinterpret_cast<D*>(sp._control_block->get_deleter()); }
+
+    // shared_ptr I/O
+    template<class E, class T, class Y, class C>
+    inline std::basic_ostream<E, T>&
+        operator<<(std::basic_ostream<E, T>& os, const shared_ptr<Y, C>& sp) {
+        os << sp.get();
+        return os;
+    }
+
+    // Control block of sp, for the bulk reference helpers below.
+    template<typename T, typename C>
+    inline control_block_base<C>* _shared_control_block(const shared_ptr<T, C>& sp) noexcept { return sp._control_block; }
+
+    // Empty sp without dropping its reference, return the control block that still accounts for it.
+    template<typename T, typename C>
+    inline control_block_base<C>* _detach_shared(shared_ptr<T, C>& sp) noexcept {
+        auto* cb = sp._control_block;
+        sp._ptr = nullptr;
+        sp._control_block = nullptr;
+        return cb;
+    }
+
+    // Reference count changes summed per control block, applied as one inc_ref(n) or dec_ref(n)
+    // per distinct block. A small open addressing table, flushed when three quarters full,
+    // so any number of pointers is handled without allocating.
+    template<typename C, bool Release>
+    class _ref_batch {
+    public:
+        _ref_batch() noexcept = default;
+        ~_ref_batch() { flush(); }
+
+        void add(control_block_base<C>* cb) noexcept {
+            if (!cb)
+                return;
+            std::size_t i = _hash(cb);
+            while (_slots[i].cb && _slots[i].cb != cb)
+                i = (i + 1) & (_size - 1);
+            if (_slots[i].cb) {
+                ++_slots[i].n;
+                return;
+            }
+            if (_used == _size * 3 / 4) {
+                flush();
+                i = _hash(cb);
+            }
+            _slots[i] = { cb, 1 };
+            ++_used;
+        }
+
+        void flush() noexcept {
+            for (auto& s : _slots) {
+                if (s.cb) {
+                    if (Release)
+                        s.cb->dec_ref(s.n);
+                    else
+                        s.cb->inc_ref(s.n);
+                    s = { nullptr, 0 };
+                }
+            }
+            _used = 0;
+        }
+
+        _ref_batch(const _ref_batch&) = delete;
+        _ref_batch& operator=(const _ref_batch&) = delete;
+
+    private:
+        static constexpr std::size_t _size = 64;
+
+        static std::size_t _hash(const void* p) noexcept {
+            auto h = reinterpret_cast<std::uintptr_t>(p) >> 4; // blocks are at least 16 bytes apart
+            return static_cast<std::size_t>(h ^ (h >> 6)) & (_size - 1);
+        }
+
+        struct _slot {
+            control_block_base<C>* cb;
+            long n;
+        };
+        _slot _slots[_size] = {};
+        std::size_t _used = 0;
+    };
+
+    // Copy the shared_ptr in [first, last) to out, taking the new references with one atomic
+    // operation per distinct control block instead of one per element.
+    // If writing to out throws, the references not yet handed out are dropped again.
+    template<typename ForwardIt, typename OutputIt>
+    OutputIt copy_shared(ForwardIt first, ForwardIt last, OutputIt out) {
+        using _Sp = typename std::iterator_traits<ForwardIt>::value_type;
+        using _C = typename _Sp::counter_type;
+        {
+            _ref_batch<_C, false> refs;
+            for (ForwardIt it = first; it != last; ++it)
+                refs.add(_shared_control_block(*it));
+        }
+        ForwardIt it = first;
+        try {
+            for (; it != last; ++out) {
+                auto sp = _adopt_shared<typename _Sp::element_type, _C>(it->get(), _shared_control_block(*it));
+                ++it; // the reference of this element is owned by sp from here on
+                *out = std::move(sp);
+            }
+        }
+        catch (...) {
+            _ref_batch<_C, true> unused;
+            for (; it != last; ++it)
+                unused.add(_shared_control_block(*it));
+            throw;
+        }
+        return out;
+    }
+
+    // Write n copies of sp to out, taking all the references with a single operation.
+    // If writing to out throws, the references not yet handed out are dropped again.
+    template<typename T, typename C, typename OutputIt>
+    OutputIt fill_shared(const shared_ptr<T, C>& sp, std::size_t n, OutputIt out) {
+        auto* cb = _shared_control_block(sp);
+        if (!cb || n == 0) {
+            for (; n > 0; --n, ++out)
+                *out = sp;
+            return out;
+        }
+        cb->inc_ref(static_cast<long>(n));
+        try {
+            for (; n > 0; ++out) {
+                auto copy = _adopt_shared<T, C>(sp.get(), cb);
+                --n; // the reference is owned by copy from here on
+                *out = std::move(copy);
+            }
+        }
+        catch (...) {
+            if (n > 0)
+                cb->dec_ref(static_cast<long>(n));
+            throw;
+        }
+        return out;
+    }
+
+    // Reset every shared_ptr in [first, last), dropping the references with one atomic
+    // operation per distinct control block. Objects are destroyed as their last references go.
+    template<typename ForwardIt>
+    void release_shared(ForwardIt first, ForwardIt last) noexcept {
+        using _Sp = typename std::iterator_traits<ForwardIt>::value_type;
+        _ref_batch<typename _Sp::counter_type, true> refs;
+        for (; first != last; ++first)
+            refs.add(_detach_shared(*first));
+    }
+
+    // Lock-free atomic shared_ptr, for publishing read-mostly snapshots between threads. A split count:
+    // the word packs the address of a snapshot holding the stored shared_ptr with the readers claiming it.
+    // Snapshots must fit 48 bits on 64-bit targets, a tagged (MTE) or wider address makes store() throw bad_alloc.
+    template<typename T>
+    class atomic_shared_ptr {
+        using _Word = std::uint64_t;
+
+        static_assert(sizeof(void*) == 8 || sizeof(void*) == 4, "snapshot addresses are packed in a 64-bit word");
+        // Pointer bits of the word, the remaining high bits hold the claim count.
+        static constexpr int _ptr_bits = (sizeof(void*) == 8) ? 48 : 32;
+        static constexpr _Word _ptr_mask = (_Word{ 1 } << _ptr_bits) - 1;
+        static constexpr _Word _claim = _Word{ 1 } << _ptr_bits;
+        // Claims moved from the word to the snapshot at once, leaves headroom before the claim count overflows.
+        static constexpr long long _refill_at = 1LL << (64 - _ptr_bits - 2);
+        // Bias of the done count while the snapshot is in the word, above any claim count the word holds.
+        static constexpr long long _published = 1LL << (64 - _ptr_bits);
+
+        struct _Snapshot {
+            shared_ptr<T> value;
+            std::atomic<long long> done{ _published }; // _published while in the word, plus the claims counted, minus those done
+        };
+
+    public:
+        using value_type = shared_ptr<T>;
+
+        static constexpr bool is_always_lock_free = std::atomic<_Word>::is_always_lock_free;
+
+        // Default ctor, holds an empty shared_ptr.
+        constexpr atomic_shared_ptr() noexcept : _word{ 0 } { }
+        // Construct holding sp.
+        atomic_shared_ptr(shared_ptr<T> sp) : _word{ _make(std::move(sp)) } { }
+        ~atomic_shared_ptr() { _release(_word.load(std::memory_order_relaxed)); }
+
+        atomic_shared_ptr(const atomic_shared_ptr&) = delete;
+        atomic_shared_ptr& operator=(const atomic_shared_ptr&) = delete;
+
+        // Store sp.
+        void operator=(shared_ptr<T> sp) { store(std::move(sp)); }
+        // Load the stored value.
+        operator shared_ptr<T>() const noexcept { return load(); }
+
+        bool is_lock_free() const noexcept { return _word.is_lock_free(); }
+
+        // Load the stored value: a fetch_add on the atomic word, the copy, and a fetch_sub on the snapshot.
+        shared_ptr<T> load(std::memory_order order = std::memory_order_seq_cst) const noexcept {
+            _Snapshot* s = _acquire(order);
+            if (!s)
+                return shared_ptr<T>{};
+            shared_ptr<T> value = s->value;
+            _done(s);
+            return value;
+        }
+
+        // Replace the stored value with sp.
+        void store(shared_ptr<T> sp, std::memory_order order = std::memory_order_seq_cst) {
+            _release(_word.exchange(_make(std::move(sp)), _rmw_order(order)));
+        }
+
+        // Replace the stored value with sp, return the previous value.
+        shared_ptr<T> exchange(shared_ptr<T> sp, std::memory_order order = std::memory_order_seq_cst) {
+            return _take(_word.exchange(_make(std::move(sp)), _rmw_order(order)));
+        }
+
+        // Store desired if the stored value is equivalent to expected (same pointer, same owner),
+        // otherwise load the stored value into expected.
+        bool compare_exchange_strong(shared_ptr<T>& expected, shared_ptr<T> desired,
+                                     std::memory_order order = std::memory_order_seq_cst) {
+            _Word next = 0;
+            bool prepared = false;
+            for (;;) {
+                // The claim keeps s from being freed, so its address cannot be reused meanwhile.
+                _Snapshot* s = _acquire(std::memory_order_acquire);
+                if (!_equivalent(s, expected)) {
+                    expected = s ? s->value : shared_ptr<T>{};
+                    _done(s);
+                    if (prepared)
+                        _release(next);
+                    return false;
+                }
+                if (!prepared) {
+                    try {
+                        next = _make(std::move(desired));
+                    }
+                    catch (...) {
+                        _done(s);
+                        throw;
+                    }
+                    prepared = true;
+                }
+                _Word w = _word.load(std::memory_order_relaxed);
+                while (_snapshot(w) == s) {
+                    if (_word.compare_exchange_weak(w, next, _rmw_order(order), std::memory_order_relaxed)) {
+                        _release(w);
+                        _done(s);
+                        return true;
+                    }
+                }
+                _done(s); // replaced meanwhile, compare with the new value
+            }
+        }
+        bool compare_exchange_strong(shared_ptr<T>& expected, shared_ptr<T> desired,
+                                     std::memory_order success, std::memory_order) {
+            return compare_exchange_strong(expected, std::move(desired), success);
+        }
+
+        // Same as compare_exchange_strong, it does not fail spuriously.
+        bool compare_exchange_weak(shared_ptr<T>& expected, shared_ptr<T> desired,
+                                   std::memory_order order = std::memory_order_seq_cst) {
+            return compare_exchange_strong(expected, std::move(desired), order);
+        }
+        bool compare_exchange_weak(shared_ptr<T>& expected, shared_ptr<T> desired,
+                                   std::memory_order success, std::memory_order) {
+            return compare_exchange_strong(expected, std::move(desired), success);
+        }
+
+    private:
+        // Read-modify-write order at least acquire/release, snapshots are published through the word.
+        static constexpr std::memory_order _rmw_order(std::memory_order order) noexcept {
+            return (order == std::memory_order_seq_cst) ? order : std::memory_order_acq_rel;
+        }
+
+        static _Snapshot* _snapshot(_Word w) noexcept {
+            return reinterpret_cast<_Snapshot*>(static_cast<std::uintptr_t>(w & _ptr_mask));
+        }
+        static long long _claims(_Word w) noexcept { return static_cast<long long>(w >> _ptr_bits); }
+
+        // Wrap sp in a new snapshot, an empty sp needs none.
+        static _Word _make(shared_ptr<T>&& sp) {
+            if (!sp._ptr && !sp._control_block)
+                return 0;
+            auto* s = new _Snapshot{ std::move(sp) };
+            auto w = static_cast<_Word>(reinterpret_cast<std::uintptr_t>(s));
+            if ((w & ~_ptr_mask) != 0) {
+                delete s;
+                throw std::bad_alloc{};
+            }
+            return w;
+        }
+
+        // Claim the stored snapshot, moving claims to it before the count in the word overflows.
+        _Snapshot* _acquire(std::memory_order order) const noexcept {
+            _Word w = _word.fetch_add(_claim, _rmw_order(order));
+            _Snapshot* s = _snapshot(w);
+            if (s && _claims(w) + 1 >= _refill_at) {
+                s->done.fetch_add(_refill_at, std::memory_order_relaxed);
+                w += _claim;
+                while (_snapshot(w) == s && _claims(w) >= _refill_at) {
+                    if (_word.compare_exchange_weak(w, w - _refill_at * _claim, std::memory_order_relaxed))
+                        return s;
+                }
+                s->done.fetch_sub(_refill_at, std::memory_order_relaxed); // replaced or refilled meanwhile
+            }
+            return s;
+        }
+
+        // Done with a claim: the last one frees a snapshot that left the word.
+        static void _done(_Snapshot* s) noexcept {
+            if (s && s->done.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                delete s;
+        }
+
+        // A word that left the atomic: count its claims in the snapshot, freeing it if they are all done.
+        static void _release(_Word w) noexcept {
+            _Snapshot* s = _snapshot(w);
+            if (s && s->done.fetch_add(_claims(w) - _published, std::memory_order_acq_rel) == _published - _claims(w))
+                delete s;
+        }
+
+        // As _release, returning the stored value: moved out if no claim is pending, copied otherwise.
+        static shared_ptr<T> _take(_Word w) noexcept {
+            _Snapshot* s = _snapshot(w);
+            if (!s)
+                return shared_ptr<T>{};
+            if (s->done.fetch_add(_claims(w) - _published + 1, std::memory_order_acq_rel) == _published - _claims(w)) {
+                shared_ptr<T> value = std::move(s->value);
+                delete s;
+                return value;
+            }
+            shared_ptr<T> value = s->value;
+            _done(s);
+            return value;
+        }
+
+        // Equivalent: same stored pointer and same owner.
+        static bool _equivalent(const _Snapshot* s, const shared_ptr<T>& expected) noexcept {
+            if (!s)
+                return !expected._ptr && !expected._control_block;
+            return s->value._ptr == expected._ptr && s->value._control_block == expected._control_block;
+        }
+
+        mutable std::atomic<_Word> _word;
+    };
+
+    // Hazard pointer slots for hazard_cell readers, in records of slots_per_thread on their own cache line.
+    // A thread takes records from a lock-free list when it first reads and gives them back when it exits;
+    // records are never freed.
+    class hazard_domain {
+    public:
+        static constexpr int slots_per_thread = 4;
+
+        struct alignas(cache_line_size) record {
+            std::atomic<const void*> slots[slots_per_thread];
+            std::atomic<bool> active;
+            record* next;
+            unsigned used; // slots in use, only touched by the owning thread
+        };
+
+        // Claim a slot of the calling thread and return it in rec and index.
+        static void acquire_slot(record*& rec, int& index) {
+            _thread_t& t = _thread();
+            for (record* r : t.records) {
+                for (int i = 0; i < slots_per_thread; ++i) {
+                    if (!(r->used & (1u << i))) {
+                        r->used |= 1u << i;
+                        rec = r;
+                        index = i;
+                        return;
+                    }
+                }
+            }
+            rec = _acquire_record();
+            t.records.push_back(rec);
+            rec->used = 1;
+            index = 0;
+        }
+
+        // Clear and give back a slot, on the thread that acquired it.
+        static void release_slot(record* rec, int index) noexcept {
+            rec->slots[index].store(nullptr, std::memory_order_release);
+            rec->used &= ~(1u << index);
+        }
+
+        // Append every pointer currently protected by a reader to out.
+        static void collect(std::vector<const void*>& out) {
+            for (record* r = _head().load(std::memory_order_acquire); r; r = r->next) {
+                for (auto& s : r->slots) {
+                    if (const void* p = s.load(std::memory_order_seq_cst))
+                        out.push_back(p);
+                }
+            }
+        }
+
+    private:
+        struct _thread_t {
+            ~_thread_t() {
+                for (record* r : records) {
+                    for (auto& s : r->slots)
+                        s.store(nullptr, std::memory_order_relaxed);
+                    r->used = 0;
+                    r->active.store(false, std::memory_order_release);
+                }
+            }
+            std::vector<record*> records;
+        };
+
+        static _thread_t& _thread() {
+            static thread_local _thread_t t;
+            return t;
+        }
+
+        static std::atomic<record*>& _head() noexcept {
+            static std::atomic<record*> head{ nullptr };
+            return head;
+        }
+
+        // Reuse a record given back by an exited thread, or push a new one.
+        static record* _acquire_record() {
+            for (record* r = _head().load(std::memory_order_acquire); r; r = r->next) {
+                bool active = false;
+                if (!r->active.load(std::memory_order_relaxed) && r->active.compare_exchange_strong(active, true, std::memory_order_acquire))
+                    return r;
+            }
+            record* r = new record{ {}, { true }, nullptr, 0 };
+            for (auto& s : r->slots)
+                s.store(nullptr, std::memory_order_relaxed);
+            r->next = _head().load(std::memory_order_relaxed);
+            while (!_head().compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed)) { }
+            return r;
+        }
+    };
+
+    template<typename T> class hazard_cell;
+
+    // Read-side protection of one version published in a hazard_cell. While the guard lives the
+    // version and its object are not destroyed, yet no reference count was touched to get it.
+    // A guard must be released on the thread that created it; each thread can hold any number.
+    template<typename T>
+    class hazard_guard {
+    public:
+        // Default ctor, protects nothing
+        hazard_guard() noexcept = default;
+        hazard_guard(hazard_guard&& g) noexcept : _version{ g._version }, _rec{ g._rec }, _index{ g._index } { g._rec = nullptr; g._version = nullptr; }
+        hazard_guard& operator=(hazard_guard&& g) noexcept {
+            hazard_guard{ std::move(g) }.swap(*this);
+            return *this;
+        }
+        ~hazard_guard() { reset(); }
+
+        // Stop protecting the version
+        void reset() noexcept {
+            if (_rec)
+                hazard_domain::release_slot(_rec, _index);
+            _rec = nullptr;
+            _version = nullptr;
+        }
+
+        void swap(hazard_guard& g) noexcept {
+            std::swap(_version, g._version);
+            std::swap(_rec, g._rec);
+            std::swap(_index, g._index);
+        }
+
+        // Borrowed pointer to the protected object, valid until the guard is reset
+        const T* get() const noexcept { return _version ? _version->get() : nullptr; }
+        const T& operator*() const noexcept { return *get(); }
+        const T* operator->() const noexcept { return get(); }
+        explicit operator bool() const noexcept { return get() != nullptr; }
+
+        // Take shared ownership of the protected version, to keep it past the guard
+        shared_ptr<T> lock() const noexcept { return _version ? *_version : shared_ptr<T>{}; }
+
+        hazard_guard(const hazard_guard&) = delete;
+        hazard_guard& operator=(const hazard_guard&) = delete;
+
+    private:
+        friend class hazard_cell<T>;
+
+        const shared_ptr<T>* _version = nullptr;
+        hazard_domain::record* _rec = nullptr;
+        int _index = 0;
+    };
+
+    // Cell publishing versions of a read-mostly object, read through hazard pointers: protect() only
+    // writes the reader's own slot. store() retires the old version, released once no guard protects it;
+    // retired versions are scanned every _reclaim_threshold writes or on reclaim().
+    template<typename T>
+    class hazard_cell {
+    public:
+        using value_type = shared_ptr<T>;
+
+        // Default ctor, the cell holds nothing
+        hazard_cell() noexcept = default;
+        // Construct holding sp
+        explicit hazard_cell(shared_ptr<T> sp) : _current{ _version(std::move(sp)) } { }
+        // No guard may be alive when the cell is destroyed
+        ~hazard_cell() {
+            delete _current.load(std::memory_order_relaxed);
+            for (auto* v : _retired)
+                delete v;
+        }
+
+        // Protect the current version for reading
+        hazard_guard<T> protect() const {
+            hazard_guard<T> g;
+            hazard_domain::acquire_slot(g._rec, g._index);
+            auto& slot = g._rec->slots[g._index];
+            shared_ptr<T>* v = _current.load(std::memory_order_seq_cst);
+            for (;;) {
+                slot.store(v, std::memory_order_seq_cst);
+                shared_ptr<T>* w = _current.load(std::memory_order_seq_cst);
+                if (w == v)
+                    break;
+                v = w; // replaced before the hazard was visible, retry
+            }
+            g._version = v;
+            return g;
+        }
+
+        // Copy of the current version, takes one reference
+        shared_ptr<T> load() const { return protect().lock(); }
+
+        // Publish sp, the previous version is retired
+        void store(shared_ptr<T> sp) { _retire(_current.exchange(_version(std::move(sp)), std::memory_order_seq_cst)); }
+
+        // Publish sp and return the previous version
+        shared_ptr<T> exchange(shared_ptr<T> sp) {
+            shared_ptr<T>* old = _current.exchange(_version(std::move(sp)), std::memory_order_seq_cst);
+            shared_ptr<T> r = old ? *old : shared_ptr<T>{};
+            _retire(old);
+            return r;
+        }
+
+        // Release every retired version no guard protects
+        void reclaim() {
+            std::vector<shared_ptr<T>*> unused;
+            {
+                std::lock_guard<std::mutex> lock{ _mutex };
+                _scan(unused);
+            }
+            for (auto* v : unused)
+                delete v; // outside the lock, may run destructors
+        }
+
+        hazard_cell(const hazard_cell&) = delete;
+        hazard_cell& operator=(const hazard_cell&) = delete;
+
+    private:
+        static constexpr std::size_t _reclaim_threshold = 32;
+
+        static shared_ptr<T>* _version(shared_ptr<T> sp) { return sp ? new shared_ptr<T>{ std::move(sp) } : nullptr; }
+
+        void _retire(shared_ptr<T>* v) {
+            if (!v)
+                return;
+            std::vector<shared_ptr<T>*> unused;
+            {
+                std::lock_guard<std::mutex> lock{ _mutex };
+                _retired.push_back(v);
+                if (_retired.size() >= _reclaim_threshold)
+                    _scan(unused);
+            }
+            for (auto* u : unused)
+                delete u;
+        }
+
+        // Move the retired versions that are not protected to unused. Called with _mutex held.
+        void _scan(std::vector<shared_ptr<T>*>& unused) {
+            std::vector<const void*> hazards;
+            hazard_domain::collect(hazards);
+            std::sort(hazards.begin(), hazards.end());
+            auto keep = std::partition(_retired.begin(), _retired.end(), [&hazards](shared_ptr<T>* v) {
+                return std::binary_search(hazards.begin(), hazards.end(), static_cast<const void*>(v));
+            });
+            unused.assign(keep, _retired.end());
+            _retired.erase(keep, _retired.end());
+        }
+
+        std::atomic<shared_ptr<T>*> _current{ nullptr };
+        std::mutex _mutex;
+        std::vector<shared_ptr<T>*> _retired;
+    };
+
+    // unique_ptr for single objects.
+    template<typename T, typename D = default_delete<T>>
+    class unique_ptr {
+    public:
+        using pointer = T*;
+        using deleter_type = D;
+
+        // Default ctor, creates a unique_ptr that owns nothing.
+        constexpr unique_ptr() noexcept = default;
+        // Construct with nullptr, creates a unique_ptr that owns nothing
+        constexpr unique_ptr(std::nullptr_t) noexcept { }
+        // Take ownership from a pointer
+        explicit unique_ptr(T* p) noexcept : _impl{ p } { }
+        // Take ownership from a pointer, supplied with a custom deleter
+        // d: a reference to a deleter.
+        unique_ptr(T* p, typename std::conditional<std::is_reference<deleter_type>::value, deleter_type, const deleter_type&>::type d) noexcept : _impl{ p, d } { }
+        // Take ownership from a pointer, supplied with a custom deleter
+        // d: an rvalue reference to a deleter.
+        // Not permitted if deleter_type is an lvalue reference.
+        unique_ptr(T* p, typename std::remove_reference<deleter_type>::type&& d) noexcept : _impl{ p, std::move(d) } 
+        { static_assert(!std::is_reference<deleter_type>::value, "rvalue deleter bound to reference"); }
+        // Move ctor: takes ownership from a unique_ptr of the same type
+        unique_ptr(unique_ptr&& up) noexcept : _impl{ up.release(), std::forward<deleter_type>(up.get_deleter()) } { }
+        // Move ctor: takes ownership from a unique_ptr of a different type
+        template <typename U, typename E>
+        unique_ptr(unique_ptr<U, E>&& up) noexcept : _impl{ up.release(), std::forward<E>(up.get_deleter()) } { }
+        // Invoke the deleter if the stored pointer is not null
+        ~unique_ptr() noexcept {
+            auto _ptr = _impl._impl_ptr();
+            auto& _deleter = _impl._impl_deleter();
+            if (_ptr)
+                _deleter(_ptr);
+        }
+        // Move assignment: takes ownership from a unique_ptr of the same type
+        unique_ptr& operator=(unique_ptr&& up) noexcept {
+            reset(up.release());
+            auto& _deleter = _impl._impl_deleter();
+            _deleter = up.get_deleter();
+            return *this;
+        }
+        // Move assignment: takes ownership from a unique_ptr of a different type
+        template <typename U, typename E>
+        unique_ptr& operator=(unique_ptr<U, E>&& up) noexcept {
+            reset(up.release());
+            auto& _deleter = _impl._impl_deleter();
+            _deleter = up.get_deleter();
+            return *this;
+        }
+        // Reset unique_ptr to empty if assigned to nullptr 
+        unique_ptr& operator=(std::nullptr_t) noexcept {
+            reset();
+            return *this;
+        }
+
+        // Dereference pointer to the managed object
+        T& operator*() const noexcept {
+            auto _ptr = _impl._impl_ptr();
+            assert(_ptr != nullptr);
+            return *_ptr;
+        }
+        T* operator->() const noexcept {
+            auto _ptr = _impl._impl_ptr();
+            assert(_ptr != nullptr);
+            return _ptr;
+        }
+
+        // Get the stored pointer
+        T* get() const noexcept { return _impl._impl_ptr(); }
+
+        // Get a reference to the stored deleter
+        deleter_type& get_deleter() noexcept { return _impl._impl_deleter(); }
+
+        // Get a const reference to the stored deleter
+        const deleter_type& get_deleter() const noexcept { return _impl._impl_deleter(); }
+
+        // Check if there is an associated managed object
+        explicit operator bool() const noexcept { return (_impl._impl_ptr()) ? true : false; }
+
+        // Release ownership to the returned raw pointer
+        T* release() noexcept {
+            auto& _ptr = _impl._impl_ptr();
+            T* cp = _ptr;
+            _ptr = nullptr;
+            return cp;
+        }
+
+        // Reset unique_ptr to empty and takes ownership from a pointer
+        void reset(T* p) noexcept {
+            auto& _ptr = _impl._impl_ptr();
+            auto& _deleter = _impl._impl_deleter();
+            if (_ptr)
+                _deleter(_ptr);
+            _ptr = p;
+        }
+        // Reset unique_ptr to empty
+        void reset() noexcept {
+            auto& _ptr = _impl._impl_ptr();
+            auto& _deleter = _impl._impl_deleter();
+            if (_ptr)
+                _deleter(_ptr);
+            _ptr = pointer{}; // probably nullptr
+        }
+
+        // Swap with another unique_ptr
+        void swap(unique_ptr& up) noexcept {
+            using std::swap;
+            swap(_impl, up._impl);
+        }
+
+        // Disable copy from lvalue, disable copy constructor
+        unique_ptr(const unique_ptr&) = delete;
+        // Disable copy assignment
+        unique_ptr& operator=(const unique_ptr&) = delete;
+
+    private:
+        Ptr<T, D> _impl;
+    };
+
+    // unique_ptr for array objects with a runtime length
+    template <typename T, typename D>
+    class unique_ptr<T[], D> {
+    public:
+        using pointer = T*;
+        using deleter_type = D;
+
+        // Default ctor, creates a unique_ptr that owns nothing
+        constexpr unique_ptr() noexcept = default;
+        // Construct with nullptr, creates a unique_ptr that owns nothing
+        constexpr unique_ptr(std::nullptr_t) noexcept { }
+        // Take ownership from a pointer
+        explicit unique_ptr(T* p) noexcept : _impl{ p } { }
+        // Take ownership from a pointer, supplied with a custom deleter
+        // d: a reference to a deleter.
+        unique_ptr(T* p, typename std::conditional<std::is_reference<deleter_type>::value, deleter_type, const deleter_type&>::type d) noexcept : _impl{ p, d } { }
+        // Take ownership from a pointer, supplied with a custom deleter
+        // d: an rvalue reference to a deleter.
+        // Not permitted if deleter_type is an lvalue reference.
+        unique_ptr(T* p, typename std::remove_reference<deleter_type>::type&& d) noexcept : _impl{ p, std::move(d) } 
+        { static_assert(!std::is_reference<deleter_type>::value, "rvalue deleter bound to reference"); }
+        // Move ctor: takes ownership from a unique_ptr of the same type
+        unique_ptr(unique_ptr&& up) noexcept : _impl{ up.release(), up.get_deleter() } { }
+        // Invoke deleter if the stored pointer is not null
+        ~unique_ptr() noexcept {
+            auto _ptr = _impl._impl_ptr();
+            auto& _deleter = _impl._impl_deleter();
+            if (_ptr)
+                _deleter(_ptr);
+        }
+        // Move assignment: takes ownership from a unique_ptr of the same type
+        unique_ptr& operator= (unique_ptr&& up) noexcept {
+            reset(up.release());
+            auto& _deleter = _impl._impl_deleter();
+            _deleter = up.get_deleter();
+            return *this;
+        }
+        // Reset unique_ptr to empty if assigned to nullptr 
+        unique_ptr& operator=(std::nullptr_t) noexcept {
+            reset();
+            return *this;
         }
 
         // Index operator, dereferencing operators are not provided, bound range is not checked
@@ -694,164 +2636,1482 @@ namespace sp {
             return _ptr[i];
         }
 
-        // Get the stored pointer
-        T* get() const noexcept {
-            return _impl._impl_ptr();
-        }  
-        // Get a reference to the stored delete
-        deleter_type& get_deleter() noexcept { return _impl._impl_deleter(); }
-        // Get a const reference to the stored deleter
-        const deleter_type& get_deleter() const noexcept { return _impl._impl_deleter(); }
+        // Get the stored pointer
+        T* get() const noexcept {
+            return _impl._impl_ptr();
+        }  
+        // Get a reference to the stored delete
+        deleter_type& get_deleter() noexcept { return _impl._impl_deleter(); }
+        // Get a const reference to the stored deleter
+        const deleter_type& get_deleter() const noexcept { return _impl._impl_deleter(); }
+
+        // Check if there is an associated managed object
+        explicit operator bool() const noexcept { return (_impl._impl_ptr()) ? true : false; }
+
+        // Release ownership to the returned raw pointer
+        T* release() noexcept {
+            auto& _ptr = _impl._impl_ptr();
+            T* cp = _ptr;
+            _ptr = nullptr;
+            return cp;
+        }
+
+        // Reset unique_ptr to empty and takes ownership from a pointer
+        void reset(T* p) noexcept {
+            auto& _ptr = _impl._impl_ptr();
+            auto& _deleter = _impl._impl_deleter();
+            if (_ptr)
+                _deleter(_ptr);
+            _ptr = p;
+        }
+        // Reset unique_ptr to empty
+        void reset() noexcept {
+            auto& _ptr = _impl._impl_ptr();
+            auto& _deleter = _impl._impl_deleter();
+            if (_ptr)
+                _deleter(_ptr);
+            _ptr = pointer{}; // probably nullptr
+        }
+
+        // Swap with another unique_ptr
+        void swap(unique_ptr& up) noexcept {
+            using std::swap;
+            swap(_impl, up._impl);
+        }
+
+        // Disable copy from lvalue, disable copy constructor
+        unique_ptr(const unique_ptr&) = delete;
+        // Disable copy assignment
+        unique_ptr& operator=(const unique_ptr&) = delete;
+
+    private:
+        Ptr<T, D> _impl;
+    };
+
+    // make_unique: create a unique pointer that manages a new object. added in C++14.
+    template<typename T>
+    struct _Unique_if { using _Single_object = unique_ptr<T>; };
+    template<typename T>
+    struct _Unique_if<T[]> { using _Unknown_bound = unique_ptr<T[]>; };
+    template<typename T, std::size_t N>
+    struct _Unique_if<T[N]> { using _Known_bound = void; };
+
+    // Only for non-array types
+    template<typename T, typename... Args>
+    typename _Unique_if<T>::_Single_object make_unique(Args&&... args)
+    {
+        return unique_ptr<T>{new T{ std::forward<Args>(args)... }};
+    }
+    // Only for array types with unknown bound
+    template<typename T>
+    typename _Unique_if<T>::_Unknown_bound make_unique(std::size_t n) {
+        using U = typename std::remove_extent<T>::type;
+        return unique_ptr<T>{new U[n]{}};
+    }
+    // Only for array types with known bound: unspecified
+    template<typename T, typename... Args>
+    typename _Unique_if<T>::_Known_bound make_unique(Args&&...) = delete;
+
+    // make_unique_for_overwrite: as make_unique, but objects are default-initialized,
+    // trivial types are left uninitialized for the caller to overwrite. Added in C++20.
+    template<typename T>
+    typename _Unique_if<T>::_Single_object make_unique_for_overwrite() { return unique_ptr<T>{new T}; }
+    template<typename T>
+    typename _Unique_if<T>::_Unknown_bound make_unique_for_overwrite(std::size_t n) {
+        using U = typename std::remove_extent<T>::type;
+        return unique_ptr<T>{new U[n]};
+    }
+    // Array of n default-initialized elements, the first one aligned to al (at least alignof the element).
+    template<typename T>
+    unique_ptr<T, aligned_delete<T>> make_unique_for_overwrite(std::size_t n, std::align_val_t al,
+            typename _Unique_if<T>::_Unknown_bound* = nullptr) {
+        using U = typename std::remove_extent<T>::type;
+        if (static_cast<std::size_t>(al) < alignof(U))
+            al = std::align_val_t{ alignof(U) };
+        if (n > static_cast<std::size_t>(-1) / sizeof(U))
+            throw std::bad_array_new_length{};
+        U* p = static_cast<U*>(::operator new[](n * sizeof(U), al));
+        std::size_t i = 0;
+        try {
+            for (; i < n; ++i)
+                ::new (static_cast<void*>(p + i)) U;
+        }
+        catch (...) {
+            while (i > 0)
+                p[--i].~U();
+            ::operator delete[](static_cast<void*>(p), al);
+            throw;
+        }
+        return unique_ptr<T, aligned_delete<T>>{ p, aligned_delete<T>{ n, al } };
+    }
+    template<typename T, typename... Args>
+    typename _Unique_if<T>::_Known_bound make_unique_for_overwrite(Args&&...) = delete;
+
+    // Pointers whose objects live in a std::pmr::memory_resource, such as a per-request arena.
+    namespace pmr {
+        // Tag for the factories below: the resource is released in bulk, e.g. a monotonic_buffer_resource
+        // that is reset or destroyed, so objects are destroyed but their storage is never handed back.
+        // The pointers must not outlive the resource.
+        struct bulk_release_t { explicit bulk_release_t() = default; };
+        constexpr bulk_release_t bulk_release{};
+
+        // Destruction policy for objects allocated from a memory_resource: the object is destroyed and its
+        // storage is returned to the resource, or kept for the bulk release if there is no resource.
+        template<typename T>
+        class resource_delete {
+        public:
+            // Default ctor.
+            constexpr resource_delete() noexcept = default;
+            // Construct for objects allocated from r, nullptr if the storage is released in bulk.
+            constexpr explicit resource_delete(std::pmr::memory_resource* r) noexcept : _resource{ r } { }
+            // Converting ctor, keeps the size and alignment of the allocated type U. Only from the same type
+            // or to a T with a virtual destructor, whose most derived object gives back the allocated address.
+            template<typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value
+                && (std::is_same<typename std::remove_cv<U>::type, typename std::remove_cv<T>::type>::value
+                    || std::has_virtual_destructor<T>::value)>::type>
+            resource_delete(const resource_delete<U>& d) noexcept : _resource{ d.resource() }, _size{ d.size() }, _align{ d.alignment() } { }
+
+            // Call operator: destroy the object and deallocate its storage.
+            void operator()(T* p) const {
+                void* storage = _storage(p);
+                p->~T();
+                if (_resource)
+                    _resource->deallocate(storage, _size, _align);
+            }
+
+            std::pmr::memory_resource* resource() const noexcept { return _resource; }
+            std::size_t size() const noexcept { return _size; }
+            std::size_t alignment() const noexcept { return _align; }
+
+        private:
+            // Address returned by allocate, the start of the most derived object
+            static void* _storage(T* p) noexcept {
+                if constexpr (std::is_polymorphic<T>::value)
+                    return const_cast<void*>(dynamic_cast<const volatile void*>(p));
+                else
+                    return const_cast<void*>(static_cast<const volatile void*>(p));
+            }
+
+            std::pmr::memory_resource* _resource = nullptr;
+            std::size_t _size = sizeof(T);
+            std::size_t _align = alignof(T);
+        };
+
+        // unique_ptr to an object in a memory_resource.
+        template<typename T>
+        using unique_ptr = sp::unique_ptr<T, resource_delete<T>>;
+
+        // polymorphic_allocator that never deallocates, for resources released in bulk.
+        template<typename T>
+        class _Bulk_allocator : public std::pmr::polymorphic_allocator<T> {
+        public:
+            using std::pmr::polymorphic_allocator<T>::polymorphic_allocator;
+            template<typename U>
+            _Bulk_allocator(const _Bulk_allocator<U>& a) noexcept : std::pmr::polymorphic_allocator<T>{ a.resource() } { }
+
+            void deallocate(T*, std::size_t) noexcept { }
+        };
+
+        // Create a shared_ptr that manages a new object, the object and its control block are a single
+        // allocation from r. Objects are constructed with uses-allocator construction, so pmr containers
+        // they hold allocate from r too.
+        template<typename T, typename... Args>
+        inline typename _Shared_if<T>::_Single_object make_shared(std::pmr::memory_resource* r, Args&&... args) {
+            return sp::allocate_shared<T>(std::pmr::polymorphic_allocator<T>{ r }, std::forward<Args>(args)...);
+        }
+        // As above, when r is released in bulk: the last release destroys the object, the control block
+        // stays in r, so dropping the last reference costs no call into the resource.
+        template<typename T, typename... Args>
+        inline typename _Shared_if<T>::_Single_object make_shared(bulk_release_t, std::pmr::memory_resource* r, Args&&... args) {
+            return sp::allocate_shared<T>(_Bulk_allocator<T>{ r }, std::forward<Args>(args)...);
+        }
+
+        // Create a unique_ptr that manages a new object allocated from r, constructed as by make_shared.
+        template<typename T, typename... Args>
+        inline typename std::enable_if<!std::is_array<T>::value, unique_ptr<T>>::type make_unique(std::pmr::memory_resource* r, Args&&... args) {
+            std::pmr::polymorphic_allocator<T> a{ r };
+            T* p = a.allocate(1);
+            try {
+                a.construct(p, std::forward<Args>(args)...);
+            }
+            catch (...) {
+                a.deallocate(p, 1);
+                throw;
+            }
+            return unique_ptr<T>{ p, resource_delete<T>{ r } };
+        }
+        // As above, when r is released in bulk: the deleter only destroys the object.
+        template<typename T, typename... Args>
+        inline typename std::enable_if<!std::is_array<T>::value, unique_ptr<T>>::type make_unique(bulk_release_t, std::pmr::memory_resource* r, Args&&... args) {
+            std::pmr::polymorphic_allocator<T> a{ r };
+            T* p = a.allocate(1);
+            a.construct(p, std::forward<Args>(args)...); // on failure the storage goes with the bulk release
+            return unique_ptr<T>{ p, resource_delete<T>{} };
+        }
+    } // namespace pmr
+
+    // Operator overloading.
+    template<typename T, typename D, typename U, typename E>
+    inline bool operator==(const unique_ptr<T, D>& up1, const unique_ptr<U, E>& up2) { return up1.get() == up2.get(); }
+    template<typename T, typename D>
+    inline bool operator==(const unique_ptr<T, D>& up, std::nullptr_t) noexcept { return !up; }
+    template<typename T, typename D>
+    inline bool operator==(std::nullptr_t, const unique_ptr<T, D>& up) noexcept { return !up; }
+
+    template<typename T, typename D, typename U, typename E>
+    inline bool operator!=(const unique_ptr<T, D>& up1, const unique_ptr<U, E>& up2) { return up1.get() != up2.get(); }
+    template<typename T, typename D>
+    inline bool operator!=(const unique_ptr<T, D>& up, std::nullptr_t) noexcept { return bool{ up }; }
+    template<typename T, typename D>
+    inline bool operator!=(std::nullptr_t, const unique_ptr<T, D>& up) noexcept { return bool{ up }; }
+
+    template<typename T, typename D, typename U, typename E>
+    inline bool operator<(const unique_ptr<T, D>& up1, const unique_ptr<U, E>& up2) {
+        using _CT = typename std::common_type<typename unique_ptr<T, D>::pointer, typename unique_ptr<U, E>::pointer>::type;
+        return std::less<_CT>()(up1.get(), up2.get());
+    }
+    template<typename T, typename D>
+    inline bool operator<(const unique_ptr<T, D>& up, std::nullptr_t) {
+        return std::less<typename unique_ptr<T, D>::pointer>()(up.get(), nullptr);
+    }
+    template<typename T, typename D>
+    inline bool operator<(std::nullptr_t, const unique_ptr<T, D>& up) {
+        return std::less<typename unique_ptr<T, D>::pointer>()(nullptr, up.get());
+    }
+
+    template<typename T, typename D, typename U, typename E>
+    inline bool operator<=(const unique_ptr<T, D>& up1, const unique_ptr<U, E>& up2) { return !(up2.get() < up1.get()); }
+    template<typename T, typename D>
+    inline bool operator<=(const unique_ptr<T, D>& up, std::nullptr_t) { return !(nullptr < up.get()); }
+    template<typename T, typename D>
+    inline bool operator<=(std::nullptr_t, const unique_ptr<T, D>& up) { return !(up.get() < nullptr); }
+
+    template<typename T, typename D, typename U, typename E>
+    inline bool operator>(const unique_ptr<T, D>& up1, const unique_ptr<U, E>& up2) { return up2.get() < up1.get(); }
+    template<typename T, typename D>
+    inline bool operator>(const unique_ptr<T, D>& up, std::nullptr_t) { return nullptr < up.get(); }
+    template<typename T, typename D>
+    inline bool operator>(std::nullptr_t, const unique_ptr<T, D>& up) { return up.get() < nullptr; }
+
+    template<typename T, typename D, typename U, typename E>
+    inline bool operator>=(const unique_ptr<T, D>& up1, const unique_ptr<U, E>& up2) { return !(up1.get() < up2.get()); }
+    template<typename T, typename D>
+    inline bool operator>=(const unique_ptr<T, D>& up, std::nullptr_t) { return !(up.get() < nullptr); }
+    template<typename T, typename D>
+    inline bool operator>=(std::nullptr_t, const unique_ptr<T, D>& up) { return !(nullptr < up.get()); }
+
+    // Swap with another unique_ptr
+    template<typename T, typename D>
+    inline void swap(unique_ptr<T, D>& up1, unique_ptr<T, D>& up2) { up1.swap(up2); }
+
+    // unique_ptr I/O added in C++20 
+    template<class E, class T, class Y>
+    std::basic_ostream<E, T>& operator<<(std::basic_ostream<E, T>& os, const unique_ptr<Y>& up) {
+        os << up.get();
+        return os;
+    }
+
+    // enable_shared_from_this allows an object t that is currently managed by a shared_ptr named sp to safely generate additional shared_ptr instances
+    //  sp1, sp2, ... that all share ownership of t with sp.
+    // Publicly inheriting from enable_shared_from_this<T> provides the type T with a member function shared_from_this. If an object t of type T is
+    //  managed by a shared_ptr<T> named sp, then calling T::shared_from_this will return a new shared_ptr<T> that shares ownership of t with sp.
+    // weak_this is set by the shared_ptr constructors taking a raw pointer or a unique_ptr and by make_shared.
+    template<typename T, typename C>
+    class enable_shared_from_this {
+    private:
+        template<typename U, typename E> friend class shared_ptr;
+
+        mutable weak_ptr<T, C> weak_this;
+
+    protected:
+        constexpr enable_shared_from_this() noexcept : weak_this{} { }
+        enable_shared_from_this(const enable_shared_from_this&) noexcept : weak_this{} { }
+        enable_shared_from_this& operator=(const enable_shared_from_this&) { return *this; }
+        ~enable_shared_from_this() { }
+
+    public:
+        shared_ptr<T, C> shared_from_this() { return shared_ptr<T, C>(weak_this); }
+        shared_ptr<const T, C> shared_from_this() const { return shared_ptr<const T, C>(weak_this); }
+
+        // Non-throwing: empty if the object is not owned by a shared_ptr. Added in C++17.
+        weak_ptr<T, C> weak_from_this() noexcept { return weak_this; }
+        weak_ptr<const T, C> weak_from_this() const noexcept { return weak_this; }
+    };
+
+    // enable_shared_from_this for objects managed by local_shared_ptr
+    template<typename T>
+    using enable_local_shared_from_this = enable_shared_from_this<T, local_counter>;
+
+    // intrusive_ref_counter embeds the reference count in the object, for use with intrusive_ptr.
+    // Derive T from intrusive_ref_counter<T, C>, C is the counter policy, atomic_counter or local_counter.
+    // Copying an object does not copy its count.
+    template<typename T, typename C = atomic_counter>
+    class intrusive_ref_counter {
+        static_assert(!std::is_same<C, biased_counter>::value, "biased_counter needs a control block to release merged objects");
+
+    public:
+        // Get the number of intrusive_ptr referring to this object
+        long use_count() const noexcept { return C::load(_ref_count); }
+
+    protected:
+        constexpr intrusive_ref_counter() noexcept : _ref_count{ 0 } { }
+        intrusive_ref_counter(const intrusive_ref_counter&) noexcept : _ref_count{ 0 } { }
+        intrusive_ref_counter& operator=(const intrusive_ref_counter&) noexcept { return *this; }
+        ~intrusive_ref_counter() { }
+
+    private:
+        // Found by argument dependent lookup from intrusive_ptr
+        friend void intrusive_ptr_add_ref(const intrusive_ref_counter* p) noexcept { C::increment(p->_ref_count); }
+        friend void intrusive_ptr_release(const intrusive_ref_counter* p) noexcept {
+            if (C::decrement(p->_ref_count))
+                delete static_cast<const T*>(p);
+        }
+
+        mutable typename C::type _ref_count;
+    };
+
+    // intrusive_ptr implementation, a single pointer, the object carries its own reference count.
+    // T must provide intrusive_ptr_add_ref(T*) and intrusive_ptr_release(T*), for example by deriving from intrusive_ref_counter.
+    template<typename T>
+    class SP_TRIVIALLY_RELOCATABLE intrusive_ptr {
+    public:
+        template<typename U> friend class intrusive_ptr;
+
+        using element_type = T;
+
+        // Default ctor, creates an empty intrusive_ptr
+        constexpr intrusive_ptr() noexcept : _ptr{} { }
+        // Construct an empty intrusive_ptr
+        constexpr intrusive_ptr(std::nullptr_t) noexcept : _ptr{} { }
+        // Take a reference to p, or adopt a reference already taken if add_ref is false
+        intrusive_ptr(T* p, bool add_ref = true) : _ptr{ p } { if (_ptr && add_ref) intrusive_ptr_add_ref(_ptr); }
+        // Copy ctor
+        intrusive_ptr(const intrusive_ptr& ip) : _ptr{ ip._ptr } { if (_ptr) intrusive_ptr_add_ref(_ptr); }
+        template<typename U>
+        intrusive_ptr(const intrusive_ptr<U>& ip) : _ptr{ ip._ptr } { if (_ptr) intrusive_ptr_add_ref(_ptr); }
+        // Move ctor, no reference count traffic
+        intrusive_ptr(intrusive_ptr&& ip) noexcept : _ptr{ ip._ptr } { ip._ptr = nullptr; }
+        template<typename U>
+        intrusive_ptr(intrusive_ptr<U>&& ip) noexcept : _ptr{ ip._ptr } { ip._ptr = nullptr; }
+        ~intrusive_ptr() { if (_ptr) intrusive_ptr_release(_ptr); }
+
+        // Copy assignment
+        intrusive_ptr& operator=(const intrusive_ptr& ip) {
+            intrusive_ptr{ ip }.swap(*this);
+            return *this;
+        }
+        template<typename U>
+        intrusive_ptr& operator=(const intrusive_ptr<U>& ip) {
+            intrusive_ptr{ ip }.swap(*this);
+            return *this;
+        }
+        // Move assignment
+        intrusive_ptr& operator=(intrusive_ptr&& ip) noexcept {
+            intrusive_ptr{ std::move(ip) }.swap(*this);
+            return *this;
+        }
+        template<typename U>
+        intrusive_ptr& operator=(intrusive_ptr<U>&& ip) noexcept {
+            intrusive_ptr{ std::move(ip) }.swap(*this);
+            return *this;
+        }
+        intrusive_ptr& operator=(T* p) {
+            intrusive_ptr{ p }.swap(*this);
+            return *this;
+        }
+
+        // Reset *this to empty
+        void reset() { intrusive_ptr{}.swap(*this); }
+        // Reset *this to p, taking a reference unless add_ref is false
+        void reset(T* p, bool add_ref = true) { intrusive_ptr{ p, add_ref }.swap(*this); }
+
+        // Dereference pointer to the managed object
+        T& operator*() const noexcept { assert(_ptr != nullptr); return *_ptr; }
+        T* operator->() const noexcept { assert(_ptr != nullptr); return _ptr; }
+
+        // Get the stored pointer
+        T* get() const noexcept { return _ptr; }
+
+        // Release ownership of the reference to the returned raw pointer, the count is not changed
+        T* detach() noexcept {
+            T* p = _ptr;
+            _ptr = nullptr;
+            return p;
+        }
+
+        // Check if there is a managed object
+        explicit operator bool() const noexcept { return (_ptr) ? true : false; }
+
+        // Exchange the contents of *this and ip
+        void swap(intrusive_ptr& ip) noexcept {
+            using std::swap;
+            swap(_ptr, ip._ptr);
+        }
+
+    private:
+        T* _ptr;
+    };
+
+    // Operator overloading.
+    template<typename T, typename U>
+    inline bool operator==(const intrusive_ptr<T>& ip1, const intrusive_ptr<U>& ip2) noexcept { return ip1.get() == ip2.get(); }
+    template<typename T>
+    inline bool operator==(const intrusive_ptr<T>& ip, std::nullptr_t) noexcept { return !ip; }
+    template<typename T>
+    inline bool operator==(std::nullptr_t, const intrusive_ptr<T>& ip) noexcept { return !ip; }
+
+    template<typename T, typename U>
+    inline bool operator!=(const intrusive_ptr<T>& ip1, const intrusive_ptr<U>& ip2) noexcept { return ip1.get() != ip2.get(); }
+    template<typename T>
+    inline bool operator!=(const intrusive_ptr<T>& ip, std::nullptr_t) noexcept { return bool{ ip }; }
+    template<typename T>
+    inline bool operator!=(std::nullptr_t, const intrusive_ptr<T>& ip) noexcept { return bool{ ip }; }
+
+    template<typename T, typename U>
+    inline bool operator<(const intrusive_ptr<T>& ip1, const intrusive_ptr<U>& ip2) noexcept {
+        using _CT = typename std::common_type<T*, U*>::type;
+        return std::less<_CT>()(ip1.get(), ip2.get());
+    }
+
+    // Swap with another intrusive_ptr
+    template<typename T>
+    inline void swap(intrusive_ptr<T>& ip1, intrusive_ptr<T>& ip2) noexcept { ip1.swap(ip2); }
+
+    // intrusive_ptr casts, the count lives in the object so the result simply takes its own reference
+    template<typename T, typename U>
+    inline intrusive_ptr<T> static_pointer_cast(const intrusive_ptr<U>& ip) { return intrusive_ptr<T>{ static_cast<T*>(ip.get()) }; }
+    template<typename T, typename U>
+    inline intrusive_ptr<T> const_pointer_cast(const intrusive_ptr<U>& ip) { return intrusive_ptr<T>{ const_cast<T*>(ip.get()) }; }
+    template<typename T, typename U>
+    inline intrusive_ptr<T> dynamic_pointer_cast(const intrusive_ptr<U>& ip) { return intrusive_ptr<T>{ dynamic_cast<T*>(ip.get()) }; }
+    template<typename T, typename U>
+    inline intrusive_ptr<T> reinterpret_pointer_cast(const intrusive_ptr<U>& ip) { return intrusive_ptr<T>{ reinterpret_cast<T*>(ip.get()) }; }
+
+    // Moving casts hand the reference over, no reference count traffic
+    template<typename T, typename U>
+    inline intrusive_ptr<T> static_pointer_cast(intrusive_ptr<U>&& ip) noexcept { return intrusive_ptr<T>{ static_cast<T*>(ip.detach()), false }; }
+    template<typename T, typename U>
+    inline intrusive_ptr<T> const_pointer_cast(intrusive_ptr<U>&& ip) noexcept { return intrusive_ptr<T>{ const_cast<T*>(ip.detach()), false }; }
+    template<typename T, typename U>
+    inline intrusive_ptr<T> dynamic_pointer_cast(intrusive_ptr<U>&& ip) noexcept {
+        if (T* p = dynamic_cast<T*>(ip.get())) {
+            ip.detach();
+            return intrusive_ptr<T>{ p, false };
+        }
+        return intrusive_ptr<T>{};
+    }
+    template<typename T, typename U>
+    inline intrusive_ptr<T> reinterpret_pointer_cast(intrusive_ptr<U>&& ip) noexcept { return intrusive_ptr<T>{ reinterpret_cast<T*>(ip.detach()), false }; }
+
+    // intrusive_ptr I/O
+    template<class E, class T, class Y>
+    inline std::basic_ostream<E, T>& operator<<(std::basic_ostream<E, T>& os, const intrusive_ptr<Y>& ip) {
+        os << ip.get();
+        return os;
+    }
+
+    // Owner-based ordering of shared_ptr and weak_ptr, for ordered containers keyed by ownership.
+    template<typename T = void>
+    struct owner_less;
+
+    template<typename T, typename C>
+    struct owner_less<shared_ptr<T, C>> {
+        bool operator()(const shared_ptr<T, C>& a, const shared_ptr<T, C>& b) const noexcept { return a.owner_before(b); }
+        bool operator()(const shared_ptr<T, C>& a, const weak_ptr<T, C>& b) const noexcept { return a.owner_before(b); }
+        bool operator()(const weak_ptr<T, C>& a, const shared_ptr<T, C>& b) const noexcept { return a.owner_before(b); }
+    };
+
+    template<typename T, typename C>
+    struct owner_less<weak_ptr<T, C>> {
+        bool operator()(const weak_ptr<T, C>& a, const weak_ptr<T, C>& b) const noexcept { return a.owner_before(b); }
+        bool operator()(const shared_ptr<T, C>& a, const weak_ptr<T, C>& b) const noexcept { return a.owner_before(b); }
+        bool operator()(const weak_ptr<T, C>& a, const shared_ptr<T, C>& b) const noexcept { return a.owner_before(b); }
+    };
+
+    // Transparent, compares any mix of shared_ptr and weak_ptr. Added in C++17.
+    template<>
+    struct owner_less<void> {
+        using is_transparent = void;
+
+        template<typename A, typename B>
+        bool operator()(const A& a, const B& b) const noexcept { return a.owner_before(b); }
+    };
+
+    // Owner-based hash and equality of shared_ptr and weak_ptr, for unordered containers keyed by
+    // ownership, such as observer registries of weak_ptr. Both are transparent. Added in C++26.
+    struct owner_hash {
+        using is_transparent = void;
+
+        template<typename P>
+        std::size_t operator()(const P& p) const noexcept { return p.owner_hash(); }
+    };
+
+    struct owner_equal {
+        using is_transparent = void;
+
+        template<typename A, typename B>
+        bool operator()(const A& a, const B& b) const noexcept { return a.owner_equal(b); }
+    };
+
+    // Transparent hash and equality by stored pointer, for unordered containers keyed by smart pointers:
+    // lookups with a raw pointer touch no reference count (heterogeneous find needs C++20 containers).
+    // Hashes agree with std::hash of the smart pointer and of its element pointer.
+    struct pointer_hash {
+        using is_transparent = void;
+
+        template<typename T>
+        std::size_t operator()(T* p) const noexcept { return std::hash<T*>()(p); }
+        template<typename T, typename C>
+        std::size_t operator()(const shared_ptr<T, C>& sp) const noexcept { return (*this)(sp.get()); }
+        template<typename T, typename D>
+        std::size_t operator()(const unique_ptr<T, D>& up) const noexcept { return (*this)(up.get()); }
+        template<typename T>
+        std::size_t operator()(const intrusive_ptr<T>& ip) const noexcept { return (*this)(ip.get()); }
+    };
+
+    struct pointer_equal {
+        using is_transparent = void;
+
+        template<typename A, typename B>
+        bool operator()(const A& a, const B& b) const noexcept { return _get(a) == _get(b); }
+
+    private:
+        template<typename T>
+        static T* _get(T* p) noexcept { return p; }
+        static std::nullptr_t _get(std::nullptr_t) noexcept { return nullptr; }
+        template<typename P>
+        static auto _get(const P& p) noexcept -> decltype(p.get()) { return p.get(); }
+    };
+
+    // Check if T is trivially relocatable: moving an object to new storage and destroying the
+    // source is equivalent to copying its bytes, so containers may grow with memcpy.
+    // Uses the compiler builtin where there is one, is_trivially_copyable elsewhere.
+    template<typename T>
+    struct is_trivially_relocatable : std::integral_constant<bool,
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_is_cpp_trivially_relocatable)
+        __builtin_is_cpp_trivially_relocatable(T) ||
+#elif __has_builtin(__is_trivially_relocatable)
+        __is_trivially_relocatable(T) ||
+#endif
+#endif
+        std::is_trivially_copyable<T>::value> { };
+
+    // The smart pointers hold plain pointers and never point into themselves: their bytes can be moved.
+    template<typename T, typename C>
+    struct is_trivially_relocatable<shared_ptr<T, C>> : std::true_type { };
+    template<typename T, typename C>
+    struct is_trivially_relocatable<weak_ptr<T, C>> : std::true_type { };
+    template<typename T>
+    struct is_trivially_relocatable<intrusive_ptr<T>> : std::true_type { };
+    template<typename T, typename D>
+    struct is_trivially_relocatable<unique_ptr<T, D>> : is_trivially_relocatable<D> { };
+    template<typename T>
+    struct is_trivially_relocatable<const T> : is_trivially_relocatable<T> { };
+
+    template<typename T>
+    constexpr bool is_trivially_relocatable_v = is_trivially_relocatable<T>::value;
+
+    // Move [first, last) into the uninitialized storage at d_first and destroy the source objects.
+    // Returns the end of the destination range. The ranges must not overlap.
+    // Contiguous ranges of trivially relocatable types are copied with a single memcpy.
+    template<typename I, typename O>
+    inline O uninitialized_relocate(I first, I last, O d_first) {
+        O d_last = std::uninitialized_move(first, last, d_first);
+        std::destroy(first, last);
+        return d_last;
+    }
+
+    template<typename T>
+    inline typename std::enable_if<is_trivially_relocatable<T>::value, T*>::type
+    uninitialized_relocate(T* first, T* last, T* d_first) noexcept {
+        std::size_t n = static_cast<std::size_t>(last - first);
+        if (n)
+            std::memcpy(static_cast<void*>(d_first), static_cast<const void*>(first), n * sizeof(T));
+        return d_first + n;
+    }
+
+    // Relocate n objects starting at first, see uninitialized_relocate.
+    // Returns the ends of the source and destination ranges.
+    template<typename I, typename N, typename O>
+    inline std::pair<I, O> uninitialized_relocate_n(I first, N n, O d_first) {
+        I last = std::next(first, n);
+        return { last, sp::uninitialized_relocate(first, last, d_first) };
+    }
+
+    // Pointer stored as the distance from its own address to the target, so it stays valid when the
+    // memory holding both is mapped at different addresses, e.g. a shared segment in several processes.
+    // Both must be in the same mapping. The distance 1 encodes nullptr.
+    template<typename T>
+    class offset_ptr {
+    public:
+        template<typename U> friend class offset_ptr;
+
+        using element_type = T;
+
+        // Default ctor, a null pointer.
+        constexpr offset_ptr() noexcept = default;
+        constexpr offset_ptr(std::nullptr_t) noexcept { }
+        // Point to p, which must be in the same mapping as this offset_ptr.
+        offset_ptr(T* p) noexcept { _set(p); }
+        // Copy ctor, recomputes the distance from the new address.
+        offset_ptr(const offset_ptr& op) noexcept { _set(op.get()); }
+        template<typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+        offset_ptr(const offset_ptr<U>& op) noexcept { _set(op.get()); }
+
+        offset_ptr& operator=(const offset_ptr& op) noexcept {
+            _set(op.get());
+            return *this;
+        }
+        offset_ptr& operator=(T* p) noexcept {
+            _set(p);
+            return *this;
+        }
+
+        // Return the pointer, in the address space of the calling process.
+        T* get() const noexcept {
+            return (_offset == 1) ? nullptr : reinterpret_cast<T*>(reinterpret_cast<std::uintptr_t>(this) + _offset);
+        }
+
+        typename std::add_lvalue_reference<T>::type operator*() const noexcept { return *get(); }
+        T* operator->() const noexcept { return get(); }
+        explicit operator bool() const noexcept { return _offset != 1; }
+
+    private:
+        void _set(T* p) noexcept {
+            _offset = p ? reinterpret_cast<std::uintptr_t>(p) - reinterpret_cast<std::uintptr_t>(this) : 1;
+        }
+
+        std::uintptr_t _offset = 1; // unsigned, so negative distances wrap around
+    };
+
+    template<typename T, typename U>
+    inline bool operator==(const offset_ptr<T>& op1, const offset_ptr<U>& op2) noexcept { return op1.get() == op2.get(); }
+    template<typename T, typename U>
+    inline bool operator!=(const offset_ptr<T>& op1, const offset_ptr<U>& op2) noexcept { return op1.get() != op2.get(); }
+
+    // Allocator over a memory region, e.g. a MAP_SHARED mmap, keeping all its state inside: one process
+    // creates it, the others attach wherever they mapped it, sharing it through lock-free atomics and offsets.
+    // Blocks are recycled first-fit and never split nor merged.
+    class shared_arena {
+        struct _Free_block { offset_ptr<_Free_block> next; };
+        // Size header of every block, keeps payloads aligned to max_align_t
+        static constexpr std::size_t _header = alignof(std::max_align_t) > sizeof(std::size_t) ? alignof(std::max_align_t) : sizeof(std::size_t);
+        static constexpr std::uint64_t _magic = 0x73705f6172656e61; // "sp_arena"
+
+        static_assert(std::atomic<std::uint32_t>::is_always_lock_free && std::atomic<std::uint64_t>::is_always_lock_free,
+            "process-shared atomics must be lock-free");
+
+    public:
+        // Largest alignment of the blocks.
+        static constexpr std::size_t max_alignment = _header;
+
+        // Create an arena over the bytes of [base, base + size), its state is placed at base,
+        // which must be aligned to max_alignment.
+        static shared_arena* create(void* base, std::size_t size) {
+            if (size < _first() || reinterpret_cast<std::uintptr_t>(base) % max_alignment != 0)
+                throw std::bad_alloc{};
+            return ::new (base) shared_arena{ size };
+        }
+        // Attach to the arena created at base, possibly by another process. Returns nullptr if there is none.
+        static shared_arena* attach(void* base) noexcept {
+            auto* a = static_cast<shared_arena*>(base);
+            return (a->_signature.load(std::memory_order_acquire) == _magic) ? a : nullptr;
+        }
+
+        shared_arena(const shared_arena&) = delete;
+        shared_arena& operator=(const shared_arena&) = delete;
+
+        // Allocate n bytes aligned to align (at most max_alignment). Throws bad_alloc when the region is full.
+        void* allocate(std::size_t n, std::size_t align = max_alignment) {
+            if (align > max_alignment || n > _capacity)
+                throw std::bad_alloc{};
+            n = (n < sizeof(_Free_block)) ? _header : (n + _header - 1) / _header * _header;
+            _lock();
+            for (offset_ptr<_Free_block>* link = &_free; *link; link = &(*link)->next) {
+                _Free_block* b = link->get();
+                if (_size_of(b) >= n) {
+                    *link = b->next.get();
+                    _unlock();
+                    return b;
+                }
+            }
+            if (_header + n > _capacity - _top) { // n is bounded by _capacity, the sum cannot overflow
+                _unlock();
+                throw std::bad_alloc{};
+            }
+            unsigned char* block = _base() + _top;
+            _top += _header + n;
+            _unlock();
+            *reinterpret_cast<std::size_t*>(block) = n;
+            return block + _header;
+        }
+        // Return a block from allocate to the free list.
+        void deallocate(void* p) noexcept {
+            auto* b = ::new (p) _Free_block{};
+            _lock();
+            b->next = _free.get();
+            _free = b;
+            _unlock();
+        }
+
+        // Root object of the region, where the creator publishes what the other processes look up.
+        offset_ptr<void>& root() noexcept { return _root; }
+
+        std::size_t capacity() const noexcept { return _capacity; }
+        // Bytes handed out so far, including freed blocks and headers.
+        std::size_t used() const noexcept { return _top; }
+
+    private:
+        explicit shared_arena(std::size_t size) noexcept
+            : _capacity{ size }, _top{ _first() } {
+            _signature.store(_magic, std::memory_order_release); // publishes the state to attach
+        }
+
+        // Offset of the first block header, past the state
+        static constexpr std::size_t _first() noexcept { return (sizeof(shared_arena) + _header - 1) / _header * _header; }
+        unsigned char* _base() noexcept { return reinterpret_cast<unsigned char*>(this); }
+        static std::size_t _size_of(void* p) noexcept { return *reinterpret_cast<std::size_t*>(static_cast<unsigned char*>(p) - _header); }
+
+        void _lock() noexcept {
+            while (_spin.exchange(1, std::memory_order_acquire))
+                std::this_thread::yield();
+        }
+        void _unlock() noexcept { _spin.store(0, std::memory_order_release); }
+
+        std::atomic<std::uint64_t> _signature{ 0 };
+        std::atomic<std::uint32_t> _spin{ 0 };
+        std::size_t _capacity;
+        std::size_t _top; // offset of the first unused byte, guarded by _spin
+        offset_ptr<_Free_block> _free;
+        offset_ptr<void> _root;
+        // The region itself goes on past the state
+    };
+
+    template<typename T> class offset_shared_ptr;
+    template<typename T> class offset_weak_ptr;
+
+    // Control block of offset_shared_ptr, fused with the object in a shared_arena.
+    // No vtable, whose address would differ between processes: the object is destroyed as T.
+    template<typename T>
+    class offset_control_block {
+    public:
+        template<typename... Args>
+        explicit offset_control_block(shared_arena& a, Args&&... args) : _arena{ &a } {
+            ::new (static_cast<void*>(&_storage)) T{ std::forward<Args>(args)... };
+        }
+
+        void inc_ref() noexcept { atomic_counter::increment(_use_count); }
+        void inc_wref() noexcept { atomic_counter::increment(_weak_use_count); }
+        bool inc_ref_nz() noexcept { return atomic_counter::increment_if_not_zero(_use_count); }
+
+        void dec_ref() noexcept {
+            if (atomic_counter::decrement(_use_count)) {
+                get()->~T();
+                dec_wref();
+            }
+        }
+        void dec_wref() noexcept {
+            if (atomic_counter::decrement(_weak_use_count)) {
+                shared_arena* a = _arena.get();
+                this->~offset_control_block();
+                a->deallocate(this);
+            }
+        }
+
+        long use_count() const noexcept { return atomic_counter::load(_use_count); }
+        bool unique() const noexcept { return atomic_counter::load_acquire(_use_count) == 1; }
+        bool expired() const noexcept { return atomic_counter::load_acquire(_use_count) == 0; }
+
+        T* get() noexcept { return reinterpret_cast<T*>(&_storage); }
+
+    private:
+        static_assert(std::atomic<long>::is_always_lock_free, "process-shared atomics must be lock-free");
+
+        atomic_counter::type _use_count{ 1 };
+        atomic_counter::type _weak_use_count{ 1 }; // + 1 while _use_count > 0
+        offset_ptr<shared_arena> _arena;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type _storage;
+    };
+
+    // shared_ptr for objects in a shared_arena, a single offset_ptr to their fused control block, so it can
+    // itself live in the arena. T must be position-independent too, holding offsets rather than raw pointers.
+    // There is no aliasing nor conversion to a base class, as the block destroys the object as T.
+    template<typename T>
+    class offset_shared_ptr {
+    public:
+        template<typename U> friend class offset_weak_ptr;
+        template<typename U, typename... Args> friend offset_shared_ptr<U> make_offset_shared(shared_arena&, Args&&...);
+
+        using element_type = T;
+        using weak_type = offset_weak_ptr<T>;
+
+        // Default ctor, creates an offset_shared_ptr with no managed object.
+        constexpr offset_shared_ptr() noexcept = default;
+        constexpr offset_shared_ptr(std::nullptr_t) noexcept { }
+        // Copy ctor, shares ownership.
+        offset_shared_ptr(const offset_shared_ptr& sp) noexcept : _control_block{ sp._control_block } {
+            if (_control_block)
+                _control_block->inc_ref();
+        }
+        // Move ctor, sp is left empty.
+        offset_shared_ptr(offset_shared_ptr&& sp) noexcept : _control_block{ sp._control_block } { sp._control_block = nullptr; }
+
+        ~offset_shared_ptr() {
+            if (_control_block)
+                _control_block->dec_ref();
+        }
+
+        offset_shared_ptr& operator=(const offset_shared_ptr& sp) noexcept {
+            offset_shared_ptr{ sp }.swap(*this);
+            return *this;
+        }
+        offset_shared_ptr& operator=(offset_shared_ptr&& sp) noexcept {
+            offset_shared_ptr{ std::move(sp) }.swap(*this);
+            return *this;
+        }
+
+        void reset() noexcept { offset_shared_ptr{}.swap(*this); }
+        void swap(offset_shared_ptr& sp) noexcept {
+            offset_control_block<T>* cb = _control_block.get();
+            _control_block = sp._control_block;
+            sp._control_block = cb;
+        }
+
+        T* get() const noexcept { return _control_block ? _control_block->get() : nullptr; }
+        T& operator*() const noexcept { return *get(); }
+        T* operator->() const noexcept { return get(); }
+
+        long use_count() const noexcept { return _control_block ? _control_block->use_count() : 0; }
+        bool unique() const noexcept { return _control_block ? _control_block->unique() : false; }
+        explicit operator bool() const noexcept { return static_cast<bool>(_control_block); }
+
+    private:
+        // Adopt a block whose use count already accounts for this pointer
+        explicit offset_shared_ptr(offset_control_block<T>* cb) noexcept : _control_block{ cb } { }
+
+        offset_ptr<offset_control_block<T>> _control_block;
+    };
+
+    template<typename T, typename U>
+    inline bool operator==(const offset_shared_ptr<T>& sp1, const offset_shared_ptr<U>& sp2) noexcept { return sp1.get() == sp2.get(); }
+    template<typename T, typename U>
+    inline bool operator!=(const offset_shared_ptr<T>& sp1, const offset_shared_ptr<U>& sp2) noexcept { return sp1.get() != sp2.get(); }
+    template<typename T>
+    inline bool operator==(const offset_shared_ptr<T>& sp, std::nullptr_t) noexcept { return !sp; }
+    template<typename T>
+    inline bool operator!=(const offset_shared_ptr<T>& sp, std::nullptr_t) noexcept { return static_cast<bool>(sp); }
+
+    template<typename T>
+    inline void swap(offset_shared_ptr<T>& sp1, offset_shared_ptr<T>& sp2) noexcept { sp1.swap(sp2); }
+
+    // weak_ptr counterpart of offset_shared_ptr, also position-independent.
+    template<typename T>
+    class offset_weak_ptr {
+    public:
+        constexpr offset_weak_ptr() noexcept = default;
+        offset_weak_ptr(const offset_shared_ptr<T>& sp) noexcept : _control_block{ sp._control_block } {
+            if (_control_block)
+                _control_block->inc_wref();
+        }
+        offset_weak_ptr(const offset_weak_ptr& wp) noexcept : _control_block{ wp._control_block } {
+            if (_control_block)
+                _control_block->inc_wref();
+        }
+        offset_weak_ptr(offset_weak_ptr&& wp) noexcept : _control_block{ wp._control_block } { wp._control_block = nullptr; }
+
+        ~offset_weak_ptr() {
+            if (_control_block)
+                _control_block->dec_wref();
+        }
+
+        offset_weak_ptr& operator=(const offset_weak_ptr& wp) noexcept {
+            offset_weak_ptr{ wp }.swap(*this);
+            return *this;
+        }
+        offset_weak_ptr& operator=(offset_weak_ptr&& wp) noexcept {
+            offset_weak_ptr{ std::move(wp) }.swap(*this);
+            return *this;
+        }
+
+        void reset() noexcept { offset_weak_ptr{}.swap(*this); }
+        void swap(offset_weak_ptr& wp) noexcept {
+            offset_control_block<T>* cb = _control_block.get();
+            _control_block = wp._control_block;
+            wp._control_block = cb;
+        }
+
+        long use_count() const noexcept { return _control_block ? _control_block->use_count() : 0; }
+        bool expired() const noexcept { return _control_block ? _control_block->expired() : true; }
+
+        // Create an offset_shared_ptr that shares ownership, empty if the object was destroyed.
+        offset_shared_ptr<T> lock() const noexcept {
+            offset_control_block<T>* cb = _control_block.get();
+            return (cb && cb->inc_ref_nz()) ? offset_shared_ptr<T>{ cb } : offset_shared_ptr<T>{};
+        }
+
+    private:
+        offset_ptr<offset_control_block<T>> _control_block;
+    };
+
+    // Create an offset_shared_ptr that manages a new object, constructed with its control block in a.
+    template<typename T, typename... Args>
+    inline offset_shared_ptr<T> make_offset_shared(shared_arena& a, Args&&... args) {
+        static_assert(alignof(offset_control_block<T>) <= shared_arena::max_alignment, "over-aligned type in shared_arena");
+        void* p = a.allocate(sizeof(offset_control_block<T>), alignof(offset_control_block<T>));
+        try {
+            return offset_shared_ptr<T>{ ::new (p) offset_control_block<T>{ a, std::forward<Args>(args)... } };
+        }
+        catch (...) {
+            a.deallocate(p);
+            throw;
+        }
+    }
+
+    // Header placed right before each object of compact_shared_ptr: both counts packed into one
+    // 64-bit atomic, the use count in the low half and the weak count in the high half.
+    // The weak count is the number of compact_weak_ptr + 1 while the use count is not 0.
+    class compact_header {
+    public:
+        static constexpr std::uint64_t use_one = 1;
+        static constexpr std::uint64_t weak_one = std::uint64_t{ 1 } << 32;
+        static constexpr std::uint64_t use_mask = weak_one - 1;
+
+        compact_header() noexcept : _counts{ use_one | weak_one } { }
+
+        // A count past 2^32 - 1 would carry into the other half, so overflow terminates in every build.
+        void inc_ref() noexcept {
+            if ((_counts.fetch_add(use_one, std::memory_order_relaxed) & use_mask) == use_mask)
+                std::terminate();
+        }
+        void inc_wref() noexcept {
+            if ((_counts.fetch_add(weak_one, std::memory_order_relaxed) >> 32) == use_mask)
+                std::terminate();
+        }
+        // Take a reference only if the object is still alive: a single CAS on both counts.
+        bool inc_ref_nz() noexcept {
+            std::uint64_t c = _counts.load(std::memory_order_relaxed);
+            while (c & use_mask) {
+                if ((c & use_mask) == use_mask)
+                    std::terminate();
+                if (_counts.compare_exchange_weak(c, c + use_one, std::memory_order_acquire, std::memory_order_relaxed))
+                    return true;
+            }
+            return false;
+        }
+
+        // Drop a reference, return 1 if the object must be destroyed, 2 if the block must be released too.
+        // The last reference with no compact_weak_ptr left does both with this one operation.
+        int dec_ref() noexcept {
+            std::uint64_t c = _counts.fetch_sub(use_one, std::memory_order_release);
+            if ((c & use_mask) != 1)
+                return 0;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return (c == (weak_one | use_one)) ? 2 : 1;
+        }
+        // Drop a weak reference, return true if the block must be released.
+        bool dec_wref() noexcept {
+            if (_counts.fetch_sub(weak_one, std::memory_order_release) == weak_one) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                return true;
+            }
+            return false;
+        }
 
-        // Check if there is an associated managed object
-        explicit operator bool() const noexcept { return (_impl._impl_ptr()) ? true : false; }
+        long use_count() const noexcept { return static_cast<long>(_counts.load(std::memory_order_relaxed) & use_mask); }
+        // Acquire so that accesses made through other, already released, pointers are visible
+        bool unique() const noexcept { return (_counts.load(std::memory_order_acquire) & use_mask) == 1; }
+        bool expired() const noexcept { return (_counts.load(std::memory_order_acquire) & use_mask) == 0; }
+        long weak_use_count() const noexcept {
+            std::uint64_t c = _counts.load(std::memory_order_relaxed);
+            return static_cast<long>(c >> 32) - ((c & use_mask) ? 1 : 0);
+        }
 
-        // Release ownership to the returned raw pointer
-        T* release() noexcept {
-            auto& _ptr = _impl._impl_ptr();
-            T* cp = _ptr;
-            _ptr = nullptr;
-            return cp;
+    private:
+        std::atomic<std::uint64_t> _counts;
+    };
+
+    template<typename T> class compact_weak_ptr;
+
+    // Storage of an object of compact_shared_ptr: the header sits in the bytes just before the object,
+    // the allocation starts offset bytes before it.
+    template<typename T>
+    struct _Compact_block {
+        static constexpr std::size_t align = alignof(T) > alignof(compact_header) ? alignof(T) : alignof(compact_header);
+        static constexpr std::size_t offset = (sizeof(compact_header) + align - 1) / align * align;
+        static constexpr std::size_t size = offset + sizeof(T);
+
+        static compact_header* header(T* p) noexcept {
+            return reinterpret_cast<compact_header*>(reinterpret_cast<unsigned char*>(p) - sizeof(compact_header));
         }
 
-        // Reset unique_ptr to empty and takes ownership from a pointer
-        void reset(T* p) noexcept {
-            auto& _ptr = _impl._impl_ptr();
-            auto& _deleter = _impl._impl_deleter();
+        static void* allocate() {
+            if (align > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+                return ::operator new(size, std::align_val_t{ align });
+            return ::operator new(size);
+        }
+        static void deallocate(T* p) noexcept {
+            void* block = reinterpret_cast<unsigned char*>(p) - offset;
+            header(p)->~compact_header();
+            if (align > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+                ::operator delete(block, std::align_val_t{ align });
+            else
+                ::operator delete(block);
+        }
+
+        // Act on the result of compact_header::dec_ref
+        static void release(T* p, int what) noexcept {
+            if (what) {
+                p->~T();
+                if (what == 2 || header(p)->dec_wref())
+                    deallocate(p);
+            }
+        }
+    };
+
+    // shared_ptr that is a single pointer wide, made by make_compact_shared, which places a compact_header
+    // before the object. No aliasing, custom deleters nor conversion to a base class (the header is found
+    // from the object's address), and at most 2^32 - 1 references of each kind at a time.
+    template<typename T>
+    class SP_TRIVIALLY_RELOCATABLE compact_shared_ptr {
+        using _Block = _Compact_block<T>;
+
+    public:
+        template<typename U> friend class compact_weak_ptr;
+        template<typename U, typename... Args> friend compact_shared_ptr<U> make_compact_shared(Args&&...);
+
+        using element_type = T;
+        using weak_type = compact_weak_ptr<T>;
+
+        // Default ctor, creates a compact_shared_ptr with no managed object.
+        constexpr compact_shared_ptr() noexcept = default;
+        constexpr compact_shared_ptr(std::nullptr_t) noexcept { }
+        // Copy ctor, shares ownership.
+        compact_shared_ptr(const compact_shared_ptr& sp) noexcept : _ptr{ sp._ptr } {
             if (_ptr)
-                _deleter(_ptr);
-            _ptr = p;
+                _Block::header(_ptr)->inc_ref();
         }
-        // Reset unique_ptr to empty
-        void reset() noexcept {
-            auto& _ptr = _impl._impl_ptr();
-            auto& _deleter = _impl._impl_deleter();
+        // Move ctor, sp is left empty.
+        compact_shared_ptr(compact_shared_ptr&& sp) noexcept : _ptr{ sp._ptr } { sp._ptr = nullptr; }
+
+        ~compact_shared_ptr() {
             if (_ptr)
-                _deleter(_ptr);
-            _ptr = pointer{}; // probably nullptr
+                _Block::release(_ptr, _Block::header(_ptr)->dec_ref());
         }
 
-        // Swap with another unique_ptr
-        void swap(unique_ptr& up) noexcept {
-            using std::swap;
-            swap(_impl, up._impl);
+        compact_shared_ptr& operator=(const compact_shared_ptr& sp) noexcept {
+            compact_shared_ptr{ sp }.swap(*this);
+            return *this;
+        }
+        compact_shared_ptr& operator=(compact_shared_ptr&& sp) noexcept {
+            compact_shared_ptr{ std::move(sp) }.swap(*this);
+            return *this;
         }
 
-        // Disable copy from lvalue, disable copy constructor
-        unique_ptr(const unique_ptr&) = delete;
-        // Disable copy assignment
-        unique_ptr& operator=(const unique_ptr&) = delete;
+        void reset() noexcept { compact_shared_ptr{}.swap(*this); }
+        void swap(compact_shared_ptr& sp) noexcept { std::swap(_ptr, sp._ptr); }
+
+        T* get() const noexcept { return _ptr; }
+        T& operator*() const noexcept { return *_ptr; }
+        T* operator->() const noexcept { return _ptr; }
+
+        long use_count() const noexcept { return _ptr ? _Block::header(_ptr)->use_count() : 0; }
+        bool unique() const noexcept { return _ptr ? _Block::header(_ptr)->unique() : false; }
+        explicit operator bool() const noexcept { return _ptr != nullptr; }
 
     private:
-        Ptr<T, D> _impl;
+        // Adopt an object whose header already accounts for this pointer
+        explicit compact_shared_ptr(T* p) noexcept : _ptr{ p } { }
+
+        T* _ptr = nullptr;
     };
 
-    // make_unique: create a unique pointer that manages a new object. added in C++14.
+    template<typename T, typename U>
+    inline bool operator==(const compact_shared_ptr<T>& sp1, const compact_shared_ptr<U>& sp2) noexcept { return sp1.get() == sp2.get(); }
+    template<typename T, typename U>
+    inline bool operator!=(const compact_shared_ptr<T>& sp1, const compact_shared_ptr<U>& sp2) noexcept { return sp1.get() != sp2.get(); }
     template<typename T>
-    struct _Unique_if { using _Single_object = unique_ptr<T>; };
+    inline bool operator==(const compact_shared_ptr<T>& sp, std::nullptr_t) noexcept { return !sp; }
     template<typename T>
-    struct _Unique_if<T[]> { using _Unknown_bound = unique_ptr<T[]>; };
-    template<typename T, std::size_t N>
-    struct _Unique_if<T[N]> { using _Known_bound = void; };
+    inline bool operator!=(const compact_shared_ptr<T>& sp, std::nullptr_t) noexcept { return static_cast<bool>(sp); }
 
-    // Only for non-array types
-    template<typename T, typename... Args>
-    typename _Unique_if<T>::_Single_object make_unique(Args&&... args)
-    {
-        return unique_ptr<T>{new T{ std::forward<Args>(args)... }};
-    }
-    // Only for array types with unknown bound
     template<typename T>
-    typename _Unique_if<T>::_Unknown_bound make_unique(std::size_t n) {
-        using U = typename std::remove_extent<T>::type;
-        return unique_ptr<T>{new U[n]{}};
+    inline void swap(compact_shared_ptr<T>& sp1, compact_shared_ptr<T>& sp2) noexcept { sp1.swap(sp2); }
+
+    // weak_ptr counterpart of compact_shared_ptr, also a single pointer.
+    template<typename T>
+    class SP_TRIVIALLY_RELOCATABLE compact_weak_ptr {
+        using _Block = _Compact_block<T>;
+
+    public:
+        constexpr compact_weak_ptr() noexcept = default;
+        compact_weak_ptr(const compact_shared_ptr<T>& sp) noexcept : _ptr{ sp._ptr } {
+            if (_ptr)
+                _Block::header(_ptr)->inc_wref();
+        }
+        compact_weak_ptr(const compact_weak_ptr& wp) noexcept : _ptr{ wp._ptr } {
+            if (_ptr)
+                _Block::header(_ptr)->inc_wref();
+        }
+        compact_weak_ptr(compact_weak_ptr&& wp) noexcept : _ptr{ wp._ptr } { wp._ptr = nullptr; }
+
+        ~compact_weak_ptr() {
+            if (_ptr && _Block::header(_ptr)->dec_wref())
+                _Block::deallocate(_ptr);
+        }
+
+        compact_weak_ptr& operator=(const compact_weak_ptr& wp) noexcept {
+            compact_weak_ptr{ wp }.swap(*this);
+            return *this;
+        }
+        compact_weak_ptr& operator=(compact_weak_ptr&& wp) noexcept {
+            compact_weak_ptr{ std::move(wp) }.swap(*this);
+            return *this;
+        }
+
+        void reset() noexcept { compact_weak_ptr{}.swap(*this); }
+        void swap(compact_weak_ptr& wp) noexcept { std::swap(_ptr, wp._ptr); }
+
+        long use_count() const noexcept { return _ptr ? _Block::header(_ptr)->use_count() : 0; }
+        bool expired() const noexcept { return _ptr ? _Block::header(_ptr)->expired() : true; }
+
+        // Create a compact_shared_ptr that shares ownership, empty if the object was destroyed.
+        compact_shared_ptr<T> lock() const noexcept {
+            return (_ptr && _Block::header(_ptr)->inc_ref_nz()) ? compact_shared_ptr<T>{ _ptr } : compact_shared_ptr<T>{};
+        }
+
+    private:
+        T* _ptr = nullptr; // the object, possibly destroyed, its header is still alive
+    };
+
+    template<typename T>
+    struct is_trivially_relocatable<compact_shared_ptr<T>> : std::true_type { };
+    template<typename T>
+    struct is_trivially_relocatable<compact_weak_ptr<T>> : std::true_type { };
+
+    // Create a compact_shared_ptr that manages a new object, in one allocation with its header.
+    template<typename T, typename... Args>
+    inline compact_shared_ptr<T> make_compact_shared(Args&&... args) {
+        static_assert(!std::is_array<T>::value, "compact_shared_ptr does not manage arrays");
+        using _Block = _Compact_block<T>;
+        auto* block = static_cast<unsigned char*>(_Block::allocate());
+        T* p = reinterpret_cast<T*>(block + _Block::offset);
+        ::new (static_cast<void*>(_Block::header(p))) compact_header{};
+        try {
+            ::new (static_cast<void*>(p)) T{ std::forward<Args>(args)... };
+        }
+        catch (...) {
+            _Block::deallocate(p);
+            throw;
+        }
+        return compact_shared_ptr<T>{ p };
     }
-    // Only for array types with known bound: unspecified
+
+    // Copy-on-write pointer: copies share one immutable object, write() clones it as T first if it is shared.
+    // The object must not be observed through weak_ptr, whose lock would share an object that write()
+    // has just found unique.
+    template<typename T, typename C = atomic_counter>
+    class SP_TRIVIALLY_RELOCATABLE cow_ptr {
+    public:
+        using element_type = T;
+
+        // Default ctor, creates a cow_ptr with no object.
+        constexpr cow_ptr() noexcept = default;
+        constexpr cow_ptr(std::nullptr_t) noexcept { }
+        // Take over the object of sp, which must not be modified through other shared_ptr.
+        explicit cow_ptr(shared_ptr<T, C> sp) noexcept : _sp{ std::move(sp) } { }
+
+        // Read access, shared with every copy.
+        const T* get() const noexcept { return _sp.get(); }
+        const T& operator*() const noexcept { return *_sp; }
+        const T* operator->() const noexcept { return _sp.get(); }
+
+        // Write access: clone the object if another cow_ptr shares it, then return it.
+        // unique() acquires, so the writes of the other owners that released it happen before ours.
+        T& write() {
+            assert(_sp);
+            if (!_sp.unique())
+                _sp = basic_allocate_shared<T, C>(std::allocator<T>{}, static_cast<const T&>(*_sp));
+            return *_sp;
+        }
+
+        // Check if this is the only cow_ptr to the object, so write() will not clone.
+        bool unique() const noexcept { return _sp.unique(); }
+        long use_count() const noexcept { return _sp.use_count(); }
+        explicit operator bool() const noexcept { return static_cast<bool>(_sp); }
+
+        void reset() noexcept { _sp.reset(); }
+        void swap(cow_ptr& cp) noexcept { _sp.swap(cp._sp); }
+
+    private:
+        shared_ptr<T, C> _sp;
+    };
+
+    template<typename T, typename C>
+    inline void swap(cow_ptr<T, C>& cp1, cow_ptr<T, C>& cp2) noexcept { cp1.swap(cp2); }
+
+    template<typename T, typename C>
+    struct is_trivially_relocatable<cow_ptr<T, C>> : std::true_type { };
+
+    // Create a cow_ptr to a new object, constructed inside its control block.
     template<typename T, typename... Args>
-    typename _Unique_if<T>::_Known_bound make_unique(Args&&...) = delete;
+    inline cow_ptr<T> make_cow(Args&&... args) { return cow_ptr<T>{ sp::make_shared<T>(std::forward<Args>(args)...) }; }
 
-    // Operator overloading.
-    template<typename T, typename D, typename U, typename E>
-    inline bool operator==(const unique_ptr<T, D>& up1, const unique_ptr<U, E>& up2) { return up1.get() == up2.get(); }
-    template<typename T, typename D>
-    inline bool operator==(const unique_ptr<T, D>& up, std::nullptr_t) noexcept { return !up; }
-    template<typename T, typename D>
-    inline bool operator==(std::nullptr_t, const unique_ptr<T, D>& up) noexcept { return !up; }
+    // Statistics of an object_pool, see object_pool::stats.
+    struct object_pool_stats {
+        unsigned long long acquires; // blocks handed out
+        unsigned long long hits;     // of which recycled from a thread cache
+        unsigned long long live;     // blocks handed out and not returned yet
+        unsigned long long high_water; // most blocks obtained from operator new at once, live or cached
 
-    template<typename T, typename D, typename U, typename E>
-    inline bool operator!=(const unique_ptr<T, D>& up1, const unique_ptr<U, E>& up2) { return up1.get() != up2.get(); }
-    template<typename T, typename D>
-    inline bool operator!=(const unique_ptr<T, D>& up, std::nullptr_t) noexcept { return bool{ up }; }
-    template<typename T, typename D>
-    inline bool operator!=(std::nullptr_t, const unique_ptr<T, D>& up) noexcept { return bool{ up }; }
+        double hit_rate() const noexcept { return acquires ? static_cast<double>(hits) / static_cast<double>(acquires) : 0.0; }
+    };
 
-    template<typename T, typename D, typename U, typename E>
-    inline bool operator<(const unique_ptr<T, D>& up1, const unique_ptr<U, E>& up2) {
-        using _CT = typename std::common_type<typename unique_ptr<T, D>::pointer, typename unique_ptr<U, E>::pointer>::type;
-        return std::less<_CT>()(up1.get(), up2.get());
-    }
-    template<typename T, typename D>
-    inline bool operator<(const unique_ptr<T, D>& up, std::nullptr_t) {
-        return std::less<typename unique_ptr<T, D>::pointer>()(up.get(), nullptr);
-    }
-    template<typename T, typename D>
-    inline bool operator<(std::nullptr_t, const unique_ptr<T, D>& up) {
-        return std::less<typename unique_ptr<T, D>::pointer>()(nullptr, up.get());
-    }
+    template<typename T> class object_pool;
 
-    template<typename T, typename D, typename U, typename E>
-    inline bool operator<=(const unique_ptr<T, D>& up1, const unique_ptr<U, E>& up2) { return !(up2.get() < up1.get()); }
-    template<typename T, typename D>
-    inline bool operator<=(const unique_ptr<T, D>& up, std::nullptr_t) { return !(nullptr < up.get()); }
-    template<typename T, typename D>
-    inline bool operator<=(std::nullptr_t, const unique_ptr<T, D>& up) { return !(up.get() < nullptr); }
+    // Destruction policy of object_pool::make_unique: destroys the object and returns its storage
+    // to the pool. Stateless, so unique_ptr<T, pool_deleter<T>> stays a single pointer.
+    template<typename T>
+    class pool_deleter {
+    public:
+        constexpr pool_deleter() noexcept = default;
 
-    template<typename T, typename D, typename U, typename E>
-    inline bool operator>(const unique_ptr<T, D>& up1, const unique_ptr<U, E>& up2) { return up2.get() < up1.get(); }
-    template<typename T, typename D>
-    inline bool operator>(const unique_ptr<T, D>& up, std::nullptr_t) { return nullptr < up.get(); }
-    template<typename T, typename D>
-    inline bool operator>(std::nullptr_t, const unique_ptr<T, D>& up) { return up.get() < nullptr; }
+        void operator()(T* p) const noexcept {
+            p->~T();
+            object_pool<T>::template _release<sizeof(T)>(p);
+        }
+    };
 
-    template<typename T, typename D, typename U, typename E>
-    inline bool operator>=(const unique_ptr<T, D>& up1, const unique_ptr<U, E>& up2) { return !(up1.get() < up2.get()); }
-    template<typename T, typename D>
-    inline bool operator>=(const unique_ptr<T, D>& up, std::nullptr_t) { return !(up.get() < nullptr); }
-    template<typename T, typename D>
-    inline bool operator>=(std::nullptr_t, const unique_ptr<T, D>& up) { return !(nullptr < up.get()); }
+    // Allocator of object_pool::make_shared, draws the fused control blocks from the pool.
+    // Objects are brace-initialized, as by make_shared.
+    template<typename U, typename T>
+    class object_pool_allocator {
+    public:
+        using value_type = U;
 
-    // Swap with another unique_ptr
-    template<typename T, typename D>
-    inline void swap(unique_ptr<T, D>& up1, unique_ptr<T, D>& up2) { up1.swap(up2); }
+        constexpr object_pool_allocator() noexcept = default;
+        template<typename V>
+        constexpr object_pool_allocator(const object_pool_allocator<V, T>&) noexcept { }
 
-    // unique_ptr I/O added in C++20 
-    template<class E, class T, class Y>
-    std::basic_ostream<E, T>& operator<<(std::basic_ostream<E, T>& os, const unique_ptr<Y>& up) {
-        os << up.get();
-        return os;
-    }
+        U* allocate(std::size_t n) {
+            assert(n == 1);
+            (void)n;
+            return static_cast<U*>(object_pool<T>::template _acquire<sizeof(U)>());
+        }
+        void deallocate(U* p, std::size_t) noexcept { object_pool<T>::template _release<sizeof(U)>(p); }
 
-    // enable_shared_from_this allows an object t that is currently managed by a shared_ptr named sp to safely generate additional shared_ptr instances
-    //  sp1, sp2, ... that all share ownership of t with sp.
-    // Publicly inheriting from enable_shared_from_this<T> provides the type T with a member function shared_from_this. If an object t of type T is
-    //  managed by a shared_ptr<T> named sp, then calling T::shared_from_this will return a new shared_ptr<T> that shares ownership of t with sp.
-    // Forward declarations.
-    template<typename T> class shared_ptr;
-    template<typename T> class weak_ptr;
+        template<typename V, typename... Args>
+        void construct(V* p, Args&&... args) { ::new (static_cast<void*>(p)) V{ std::forward<Args>(args)... }; }
+    };
 
+    template<typename U, typename T, typename V>
+    inline bool operator==(const object_pool_allocator<U, T>&, const object_pool_allocator<V, T>&) noexcept { return true; }
+    template<typename U, typename T, typename V>
+    inline bool operator!=(const object_pool_allocator<U, T>&, const object_pool_allocator<V, T>&) noexcept { return false; }
+
+    // Recycling pool for frequently churned objects of type T, on a thread-caching block_pool of its own:
+    // a freed object is reused by the next one made on the same thread, make_shared recycles the whole block.
+    // Counts are per thread, only the calls into operator new and delete touch shared counters.
     template<typename T>
-    class enable_shared_from_this {
+    class object_pool {
+        static_assert(!std::is_array<T>::value, "object_pool manages single objects");
+        static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned type in object_pool");
+
+    public:
+        using unique_ptr = sp::unique_ptr<T, pool_deleter<T>>;
+        using shared_ptr = sp::shared_ptr<T>;
+
+        // Create an object in pooled storage.
+        template<typename... Args>
+        static unique_ptr make_unique(Args&&... args) {
+            void* p = _acquire<sizeof(T)>();
+            try {
+                return unique_ptr{ ::new (p) T{ std::forward<Args>(args)... } };
+            }
+            catch (...) {
+                _release<sizeof(T)>(p);
+                throw;
+            }
+        }
+
+        // Create an object with its control block in one pooled allocation.
+        template<typename... Args>
+        static shared_ptr make_shared(Args&&... args) {
+            return basic_allocate_shared<T, atomic_counter>(object_pool_allocator<T, T>{}, std::forward<Args>(args)...);
+        }
+
+        // Snapshot of the counts since the last reset_stats, exact once the threads using the pool are quiescent.
+        static object_pool_stats stats() noexcept {
+            _shared_t& g = _shared();
+            unsigned long long acquires, releases;
+            _totals(acquires, releases);
+            acquires -= g.base_acquires.load(std::memory_order_relaxed);
+            releases -= g.base_releases.load(std::memory_order_relaxed);
+            unsigned long long misses = g.misses.load(std::memory_order_relaxed);
+            return { acquires, (acquires > misses) ? acquires - misses : 0,
+                     acquires - releases + g.base_live.load(std::memory_order_relaxed), g.high_water.load(std::memory_order_relaxed) };
+        }
+        // Restart counting, the high-water mark restarts from the blocks held now.
+        static void reset_stats() noexcept {
+            _shared_t& g = _shared();
+            unsigned long long acquires, releases;
+            _totals(acquires, releases);
+            g.base_live.store(acquires - releases, std::memory_order_relaxed);
+            g.base_acquires.store(acquires, std::memory_order_relaxed);
+            g.base_releases.store(releases, std::memory_order_relaxed);
+            g.misses.store(0, std::memory_order_relaxed);
+            g.high_water.store(g.held.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+
     private:
-        weak_ptr<T> weak_this;
+        template<typename U> friend class pool_deleter;
+        template<typename U, typename V> friend class object_pool_allocator;
+        template<std::size_t Size, typename Tag> friend class block_pool;
 
-    protected:
-        constexpr enable_shared_from_this() noexcept : weak_this{} { }
-        enable_shared_from_this(const enable_shared_from_this& r) noexcept { }
-        enable_shared_from_this& operator=(const enable_shared_from_this&) { return *this; }
-        ~enable_shared_from_this() { }
+        template<std::size_t Size>
+        static constexpr std::size_t _size_class = (Size + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t);
+        template<std::size_t Size>
+        using _Pool = block_pool<_size_class<Size>, object_pool>;
 
-    public:
-        shared_ptr<T> shared_from_this() { return shared_ptr<T>(weak_this); }
-        shared_ptr<const T> shared_from_this() const { return shared_ptr<const T>(weak_this); }
+        // Counts of one thread, written only by it and handed to a later thread once it exits.
+        struct _record {
+            std::atomic<unsigned long long> acquires{ 0 };
+            std::atomic<unsigned long long> releases{ 0 };
+            std::atomic<bool> in_use{ true };
+            _record* next = nullptr;
+
+            void add(std::atomic<unsigned long long>& c) noexcept { c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+        };
+
+        struct _shared_t {
+            std::atomic<_record*> records{ nullptr };
+            std::atomic<unsigned long long> misses{ 0 };     // acquires served by operator new
+            std::atomic<unsigned long long> held{ 0 };       // blocks from operator new not deleted yet
+            std::atomic<unsigned long long> high_water{ 0 };
+            std::atomic<unsigned long long> base_acquires{ 0 }, base_releases{ 0 }, base_live{ 0 }; // at reset_stats
+            _record closed; // shared by destructors that run after their thread's record was released
+        };
+
+        static _shared_t& _shared() noexcept {
+            static _shared_t g;
+            return g;
+        }
+
+        // Sum the counts of every thread
+        static void _totals(unsigned long long& acquires, unsigned long long& releases) noexcept {
+            _shared_t& g = _shared();
+            acquires = g.closed.acquires.load(std::memory_order_relaxed);
+            releases = g.closed.releases.load(std::memory_order_relaxed);
+            for (_record* r = g.records.load(std::memory_order_acquire); r; r = r->next) {
+                acquires += r->acquires.load(std::memory_order_relaxed);
+                releases += r->releases.load(std::memory_order_relaxed);
+            }
+        }
+
+        // Called by block_pool when an exiting thread frees its n cached blocks
+        static void _drained(std::size_t n) noexcept { _shared().held.fetch_sub(n, std::memory_order_relaxed); }
+
+        // Record of the calling thread, closed once _release_t gave it back
+        struct _local_t {
+            _record* record;
+            bool closed;
+        };
+        struct _release_t {
+            ~_release_t() {
+                _local_t& l = _local_state();
+                l.closed = true;
+                l.record->in_use.store(false, std::memory_order_release);
+            }
+        };
+
+        static _local_t& _local_state() noexcept {
+            static thread_local _local_t l{ nullptr, false };
+            return l;
+        }
+
+        static _record* _local() {
+            _local_t& l = _local_state();
+            if (l.record)
+                return l.record;
+            if (l.closed)
+                return nullptr;
+            _shared_t& g = _shared();
+            for (_record* r = g.records.load(std::memory_order_acquire); r && !l.record; r = r->next) {
+                bool idle = false;
+                if (r->in_use.compare_exchange_strong(idle, true, std::memory_order_acquire))
+                    l.record = r;
+            }
+            if (!l.record) {
+                auto* r = new _record{};
+                r->next = g.records.load(std::memory_order_relaxed);
+                while (!g.records.compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed)) { }
+                l.record = r;
+            }
+            static thread_local _release_t _release; // hands the record over at thread exit
+            (void)_release;
+            return l.record;
+        }
+
+        static void _count(bool acquire) noexcept {
+            _record* r = nullptr;
+            try {
+                r = _local();
+            }
+            catch (...) { }
+            if (r)
+                r->add(acquire ? r->acquires : r->releases);
+            else {
+                _record& c = _shared().closed;
+                (acquire ? c.acquires : c.releases).fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        template<std::size_t Size>
+        static void* _acquire() {
+            void* p = _Pool<Size>::try_allocate();
+            if (!p) {
+                p = ::operator new(_size_class<Size>);
+                _shared_t& g = _shared();
+                g.misses.fetch_add(1, std::memory_order_relaxed);
+                unsigned long long held = g.held.fetch_add(1, std::memory_order_relaxed) + 1;
+                unsigned long long high = g.high_water.load(std::memory_order_relaxed);
+                while (held > high && !g.high_water.compare_exchange_weak(high, held, std::memory_order_relaxed)) { }
+            }
+            _count(true);
+            return p;
+        }
+
+        template<std::size_t Size>
+        static void _release(void* p) noexcept {
+            _count(false);
+            if (!_Pool<Size>::deallocate(p))
+                _shared().held.fetch_sub(1, std::memory_order_relaxed);
+        }
     };
 } // namespace smart_ptr
+
+namespace std {
+    // Hash of the stored pointer, as std::hash of std::shared_ptr and std::unique_ptr.
+    template<typename T, typename C>
+    struct hash<sp::shared_ptr<T, C>> {
+        size_t operator()(const sp::shared_ptr<T, C>& sp) const noexcept { return hash<typename sp::shared_ptr<T, C>::element_type*>()(sp.get()); }
+    };
+
+    template<typename T, typename D>
+    struct hash<sp::unique_ptr<T, D>> {
+        size_t operator()(const sp::unique_ptr<T, D>& up) const noexcept { return hash<typename sp::unique_ptr<T, D>::pointer>()(up.get()); }
+    };
+
+    // A weak_ptr has no stable stored pointer, it hashes its owner: use with sp::owner_equal.
+    template<typename T, typename C>
+    struct hash<sp::weak_ptr<T, C>> {
+        size_t operator()(const sp::weak_ptr<T, C>& wp) const noexcept { return wp.owner_hash(); }
+    };
+
+    // std::atomic<sp::shared_ptr<T>>, following std::atomic<std::shared_ptr<T>> from C++20.
+    template<typename T>
+    struct atomic<sp::shared_ptr<T>> : sp::atomic_shared_ptr<T> {
+        using sp::atomic_shared_ptr<T>::atomic_shared_ptr;
+        using sp::atomic_shared_ptr<T>::operator=;
+    };
+} // namespace std
@@ -0,0 +1,269 @@
+// Benchmarks of sp:: smart pointers against std::, using Google Benchmark.
+// Build:  g++ -std=c++17 -O2 -DNDEBUG -Wall -Wextra smart_ptr_benchmark.cpp -lbenchmark -lpthread -o smart_ptr_benchmark
+// Each benchmark reports ns/op as its time and allocations per op in the allocs/op counter.
+#include "smart_ptr.h"
+#include <benchmark/benchmark.h>
+#include <memory>   // std smart pointers
+#include <new>      // operator new, align_val_t, bad_alloc
+#include <cstdlib>  // malloc, aligned_alloc, free
+
+// Allocation counting: every global operator new bumps a per-thread counter, read around the timed loop.
+// Out of line, so GCC pairs them as operator new and delete rather than malloc and free (-Wmismatched-new-delete).
+static thread_local long _allocations = 0;
+
+[[gnu::noinline]] void* operator new(std::size_t n) {
+    ++_allocations;
+    if (void* p = std::malloc(n ? n : 1))
+        return p;
+    throw std::bad_alloc{};
+}
+[[gnu::noinline]] void* operator new(std::size_t n, std::align_val_t a) {
+    ++_allocations;
+    auto align = static_cast<std::size_t>(a);
+    if (void* p = std::aligned_alloc(align, (n + align - 1) / align * align))
+        return p;
+    throw std::bad_alloc{};
+}
+[[gnu::noinline]] void operator delete(void* p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void* p, std::size_t) noexcept { ::operator delete(p); }
+[[gnu::noinline]] void operator delete(void* p, std::size_t, std::align_val_t a) noexcept { ::operator delete(p, a); }
+
+// Report the allocations made since start as an average per iteration (summed across threads).
+static void report_allocations(benchmark::State& state, long start) {
+    state.counters["allocs/op"] = benchmark::Counter(static_cast<double>(_allocations - start), benchmark::Counter::kAvgIterations);
+}
+
+struct Base {
+    virtual ~Base() = default;
+    int value = 0;
+};
+struct Derived : Base {
+    int extra = 0;
+};
+
+// The two implementations under test, so that every benchmark is written once.
+struct sp_impl {
+    template<typename T> using shared_ptr = sp::shared_ptr<T>;
+    template<typename T> using weak_ptr = sp::weak_ptr<T>;
+    template<typename T> using unique_ptr = sp::unique_ptr<T>;
+
+    template<typename T, typename... Args>
+    static shared_ptr<T> make_shared(Args&&... args) { return sp::make_shared<T>(std::forward<Args>(args)...); }
+    template<typename T, typename U>
+    static shared_ptr<T> dynamic_pointer_cast(const shared_ptr<U>& p) { return sp::dynamic_pointer_cast<T>(p); }
+};
+
+struct std_impl {
+    template<typename T> using shared_ptr = std::shared_ptr<T>;
+    template<typename T> using weak_ptr = std::weak_ptr<T>;
+    template<typename T> using unique_ptr = std::unique_ptr<T>;
+
+    template<typename T, typename... Args>
+    static shared_ptr<T> make_shared(Args&&... args) { return std::make_shared<T>(std::forward<Args>(args)...); }
+    template<typename T, typename U>
+    static shared_ptr<T> dynamic_pointer_cast(const shared_ptr<U>& p) { return std::dynamic_pointer_cast<T>(p); }
+};
+
+// Construction and destruction through a raw pointer.
+template<typename I>
+static void construct_raw(benchmark::State& state) {
+    long start = _allocations;
+    for (auto _ : state) {
+        typename I::template shared_ptr<Base> p{ new Base };
+        benchmark::DoNotOptimize(p.get());
+    }
+    report_allocations(state, start);
+}
+
+// Construction and destruction through make_shared.
+template<typename I>
+static void construct_make_shared(benchmark::State& state) {
+    long start = _allocations;
+    for (auto _ : state) {
+        auto p = I::template make_shared<Base>();
+        benchmark::DoNotOptimize(p.get());
+    }
+    report_allocations(state, start);
+}
+
+// Copy and destroy one pointer shared by all the benchmark threads, so the count is contended.
+template<typename I>
+struct shared_object {
+    static typename I::template shared_ptr<Base> p;
+};
+template<typename I>
+typename I::template shared_ptr<Base> shared_object<I>::p;
+
+template<typename I>
+static void copy_destroy(benchmark::State& state) {
+    if (state.thread_index() == 0)
+        shared_object<I>::p = I::template make_shared<Base>();
+    long start = _allocations;
+    for (auto _ : state) {
+        auto copy = shared_object<I>::p;
+        benchmark::DoNotOptimize(copy.get());
+    }
+    report_allocations(state, start);
+    if (state.thread_index() == 0)
+        shared_object<I>::p.reset();
+}
+
+// weak_ptr::lock on a live object.
+template<typename I>
+static void weak_lock_hit(benchmark::State& state) {
+    auto p = I::template make_shared<Base>();
+    typename I::template weak_ptr<Base> w{ p };
+    long start = _allocations;
+    for (auto _ : state) {
+        auto locked = w.lock();
+        benchmark::DoNotOptimize(locked.get());
+    }
+    report_allocations(state, start);
+}
+
+// weak_ptr::lock on an expired object.
+template<typename I>
+static void weak_lock_miss(benchmark::State& state) {
+    typename I::template weak_ptr<Base> w{ I::template make_shared<Base>() };
+    long start = _allocations;
+    for (auto _ : state) {
+        auto locked = w.lock();
+        benchmark::DoNotOptimize(locked.get());
+    }
+    report_allocations(state, start);
+}
+
+// Aliasing constructor to a member of the owned object.
+template<typename I>
+static void aliasing(benchmark::State& state) {
+    auto p = I::template make_shared<Base>();
+    long start = _allocations;
+    for (auto _ : state) {
+        typename I::template shared_ptr<int> member{ p, &p->value };
+        benchmark::DoNotOptimize(member.get());
+    }
+    report_allocations(state, start);
+}
+
+// dynamic_pointer_cast from base to derived.
+template<typename I>
+static void dynamic_cast_(benchmark::State& state) {
+    typename I::template shared_ptr<Base> p = I::template make_shared<Derived>();
+    long start = _allocations;
+    for (auto _ : state) {
+        auto d = I::template dynamic_pointer_cast<Derived>(p);
+        benchmark::DoNotOptimize(d.get());
+    }
+    report_allocations(state, start);
+}
+
+// unique_ptr move construction back and forth.
+template<typename I>
+static void unique_move(benchmark::State& state) {
+    typename I::template unique_ptr<Base> a{ new Base };
+    long start = _allocations;
+    for (auto _ : state) {
+        typename I::template unique_ptr<Base> b{ std::move(a) };
+        benchmark::DoNotOptimize(b.get());
+        a = std::move(b);
+    }
+    report_allocations(state, start);
+}
+
+// unique_ptr reset to a new object, deleting the previous one.
+template<typename I>
+static void unique_reset(benchmark::State& state) {
+    typename I::template unique_ptr<Base> a;
+    long start = _allocations;
+    for (auto _ : state) {
+        a.reset(new Base);
+        benchmark::DoNotOptimize(a.get());
+    }
+    report_allocations(state, start);
+}
+
+// Relocation of state.range(0) shared_ptr handles between two buffers, as in vector regrowth:
+// element-wise move and destroy, against sp::uninitialized_relocate.
+template<bool Relocate>
+static void relocate_handles(benchmark::State& state) {
+    using P = sp::shared_ptr<Base>;
+    std::size_t n = static_cast<std::size_t>(state.range(0));
+    auto* a = static_cast<P*>(::operator new(n * sizeof(P)));
+    auto* b = static_cast<P*>(::operator new(n * sizeof(P)));
+    auto p = sp::make_shared<Base>();
+    std::uninitialized_fill_n(a, n, p);
+    long start = _allocations;
+    for (auto _ : state) {
+        if (Relocate)
+            sp::uninitialized_relocate(a, a + n, b);
+        else {
+            std::uninitialized_move(a, a + n, b);
+            std::destroy(a, a + n);
+        }
+        std::swap(a, b);
+        benchmark::ClobberMemory();
+    }
+    report_allocations(state, start);
+    state.SetItemsProcessed(static_cast<long>(state.iterations() * n));
+    std::destroy(a, a + n);
+    ::operator delete(a);
+    ::operator delete(b);
+}
+
+// Create and destroy an object through sp::object_pool, against sp::make_unique and sp::make_shared.
+template<bool Shared>
+static void pooled_churn(benchmark::State& state) {
+    long start = _allocations;
+    for (auto _ : state) {
+        if (Shared) {
+            auto p = sp::object_pool<Base>::make_shared();
+            benchmark::DoNotOptimize(p.get());
+        }
+        else {
+            auto p = sp::object_pool<Base>::make_unique();
+            benchmark::DoNotOptimize(p.get());
+        }
+    }
+    report_allocations(state, start);
+    state.counters["hit_rate"] = sp::object_pool<Base>::stats().hit_rate();
+}
+
+template<bool Shared>
+static void unpooled_churn(benchmark::State& state) {
+    long start = _allocations;
+    for (auto _ : state) {
+        if (Shared) {
+            auto p = sp::make_shared<Base>();
+            benchmark::DoNotOptimize(p.get());
+        }
+        else {
+            auto p = sp::make_unique<Base>();
+            benchmark::DoNotOptimize(p.get());
+        }
+    }
+    report_allocations(state, start);
+}
+
+#define SP_BENCHMARK(name) \
+    BENCHMARK_TEMPLATE(name, sp_impl); \
+    BENCHMARK_TEMPLATE(name, std_impl)
+
+SP_BENCHMARK(construct_raw);
+SP_BENCHMARK(construct_make_shared);
+BENCHMARK_TEMPLATE(copy_destroy, sp_impl)->Threads(1)->Threads(2)->Threads(8)->ThreadPerCpu()->UseRealTime();
+BENCHMARK_TEMPLATE(copy_destroy, std_impl)->Threads(1)->Threads(2)->Threads(8)->ThreadPerCpu()->UseRealTime();
+SP_BENCHMARK(weak_lock_hit);
+SP_BENCHMARK(weak_lock_miss);
+SP_BENCHMARK(aliasing);
+SP_BENCHMARK(dynamic_cast_);
+SP_BENCHMARK(unique_move);
+SP_BENCHMARK(unique_reset);
+BENCHMARK_TEMPLATE(relocate_handles, false)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(relocate_handles, true)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(unpooled_churn, false);
+BENCHMARK_TEMPLATE(pooled_churn, false);
+BENCHMARK_TEMPLATE(unpooled_churn, true);
+BENCHMARK_TEMPLATE(pooled_churn, true);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,188 @@
+// Multithreaded stress driver for the reference counting of the sp:: pointers, exits non-zero on failure.
+// Build:  g++ -std=c++17 -O1 -g -Wall -Wextra -fsanitize=address,undefined smart_ptr_stress.cpp -lpthread -o smart_ptr_stress
+// Usage:  ./smart_ptr_stress [rounds]
+#include "smart_ptr.h"
+#include <atomic>   // atomic
+#include <cstdio>   // fprintf, puts
+#include <cstdlib>  // abort, atoi
+#include <mutex>    // mutex, lock_guard
+#include <thread>   // thread
+#include <utility>  // pair
+#include <vector>   // vector
+
+// Checked in every build, NDEBUG or not
+#define SP_CHECK(...) \
+    do { \
+        if (!(__VA_ARGS__)) { \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #__VA_ARGS__); \
+            std::abort(); \
+        } \
+    } while (0)
+
+constexpr int threads = 4;
+constexpr int n = 64; // objects per worker in biased_handoff
+
+static std::atomic<long> live{ 0 };
+
+// Each thread writes its own slot with plain stores before dropping its reference. The destructor,
+// run by whichever thread drops the last one, must see every write: the release decrements and the
+// acquire before destruction order them.
+struct Payload {
+    long slots[threads] = {};
+    Payload() { live.fetch_add(1, std::memory_order_relaxed); }
+    ~Payload() {
+        for (long s : slots)
+            SP_CHECK(s == 1);
+        live.fetch_sub(1, std::memory_order_relaxed);
+    }
+};
+
+// Run f(t) on threads threads and wait for them.
+template<typename F>
+static void run(F f) {
+    std::vector<std::thread> ts;
+    for (int t = 0; t < threads; ++t)
+        ts.emplace_back(f, t);
+    for (auto& t : ts)
+        t.join();
+}
+
+// Concurrent copy and destroy of one object, the last release runs the destructor.
+template<typename Sp>
+static void copy_destroy(Sp p) {
+    std::vector<Sp> copies(threads, p);
+    p.reset();
+    run([&](int t) {
+        Sp mine = std::move(copies[t]);
+        for (int i = 0; i < 1000; ++i) {
+            Sp copy = mine;
+            Sp moved = std::move(copy);
+        }
+        mine->slots[t] = 1;
+    });
+}
+
+// weak_ptr::lock racing the last release: a lock either fails or yields a live object.
+static void weak_lock_race() {
+    auto p = sp::make_shared<Payload>();
+    sp::weak_ptr<Payload> w = p;
+    std::vector<sp::shared_ptr<Payload>> owners(threads, p);
+    p.reset();
+    run([&](int t) {
+        for (int i = 0; i < 200; ++i) {
+            if (auto l = w.lock())
+                SP_CHECK(l.use_count() >= 1);
+        }
+        owners[t]->slots[t] = 1;
+        owners[t].reset();
+    });
+    SP_CHECK(w.expired() && !w.lock());
+}
+
+// Batched copy_shared and release_shared from several threads over the same blocks.
+static void bulk_copy_release() {
+    std::vector<sp::shared_ptr<Payload>> objects;
+    for (int i = 0; i < 16; ++i)
+        objects.push_back(sp::make_shared<Payload>());
+    std::vector<std::vector<sp::shared_ptr<Payload>>> owned(threads);
+    for (auto& o : owned)
+        o = objects;
+    objects.clear();
+    run([&](int t) {
+        for (int i = 0; i < 100; ++i) {
+            std::vector<sp::shared_ptr<Payload>> copies(owned[t].size());
+            sp::copy_shared(owned[t].begin(), owned[t].end(), copies.begin());
+            sp::release_shared(copies.begin(), copies.end());
+        }
+        for (auto& p : owned[t])
+            p->slots[t] = 1;
+        sp::release_shared(owned[t].begin(), owned[t].end());
+    });
+}
+
+// Readers load an atomic_shared_ptr while writers store and compare_exchange new values.
+static void atomic_publish() {
+    auto filled = [] {
+        auto p = sp::make_shared<Payload>();
+        for (long& s : p->slots)
+            s = 1;
+        return p;
+    };
+    sp::atomic_shared_ptr<Payload> a{ filled() };
+    run([&](int t) {
+        for (int i = 0; i < 500; ++i) {
+            auto current = a.load();
+            SP_CHECK(current && current.use_count() >= 1);
+            if (i % 16 == 0) {
+                auto next = filled();
+                if (t % 2 == 0)
+                    a.store(next);
+                else
+                    a.compare_exchange_strong(current, next);
+            }
+        }
+    });
+}
+
+// Biased counts: workers reset one of two handles per object, queueing the block to the owner, and return
+// a copy of the other with it. The owner drops them and its own in one release_shared, merging as it goes.
+static void biased_handoff() {
+    std::mutex m;
+    std::vector<std::pair<int, std::vector<sp::biased_shared_ptr<Payload>>>> returned;
+    std::thread owner([&] {
+        std::vector<sp::biased_shared_ptr<Payload>> kept;
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            std::vector<sp::biased_shared_ptr<Payload>> given;
+            for (int i = 0; i < n; ++i) {
+                kept.push_back(sp::make_biased_shared<Payload>());
+                for (long& s : kept.back()->slots)
+                    s = 1;
+                given.push_back(kept.back());
+                given.push_back(kept.back());
+            }
+            workers.emplace_back([&m, &returned, t](std::vector<sp::biased_shared_ptr<Payload>> handles) {
+                for (int i = 0; i < n; ++i) {
+                    handles[2 * i].reset();
+                    std::vector<sp::biased_shared_ptr<Payload>> back{ handles[2 * i + 1], std::move(handles[2 * i + 1]) };
+                    std::lock_guard<std::mutex> lock{ m };
+                    returned.emplace_back(t * n + i, std::move(back));
+                }
+            }, std::move(given));
+        }
+        for (int done = 0; done < threads * n; ) {
+            std::vector<std::pair<int, std::vector<sp::biased_shared_ptr<Payload>>>> batch;
+            {
+                std::lock_guard<std::mutex> lock{ m };
+                batch.swap(returned);
+            }
+            for (auto& b : batch) {
+                b.second.push_back(std::move(kept[b.first]));
+                SP_CHECK(b.second.front().use_count() == 3);
+                sp::release_shared(b.second.begin(), b.second.end()); // one dec_ref(3)
+                ++done;
+            }
+            std::this_thread::yield();
+        }
+        for (auto& w : workers)
+            w.join();
+        sp::biased_counter::merge_pending();
+    });
+    owner.join();
+}
+
+int main(int argc, char** argv) {
+    int rounds = (argc > 1) ? std::atoi(argv[1]) : 200;
+    for (int r = 0; r < rounds; ++r) {
+        copy_destroy(sp::make_shared<Payload>());
+        copy_destroy(sp::shared_ptr<Payload>{ new Payload });
+        copy_destroy(sp::make_biased_shared<Payload>());
+        sp::biased_counter::merge_pending(); // the workers' last releases were queued to this thread
+        weak_lock_race();
+        bulk_copy_release();
+        atomic_publish();
+        biased_handoff();
+    }
+    SP_CHECK(live.load() == 0);
+    std::printf("smart_ptr_stress: %d rounds passed\n", rounds);
+}
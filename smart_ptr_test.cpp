@@ -0,0 +1,673 @@
+// Behavioral checks of the sp:: smart pointers, a standalone driver that exits non-zero on failure.
+// Build:  g++ -std=c++17 -g -Wall -Wextra -fsanitize=address,undefined smart_ptr_test.cpp -lpthread -o smart_ptr_test
+//         add -DSP_REFCOUNT_STATS=1 to also check the refcount_stats instrumentation
+#include "smart_ptr.h"
+#include <algorithm> // find_if
+#include <cstddef>  // ptrdiff_t
+#include <cstdint>  // uintptr_t
+#include <cstdio>   // fprintf
+#include <cstdlib>  // abort
+#include <functional> // function
+#include <iterator> // output_iterator_tag
+#include <memory_resource> // pmr::memory_resource
+#include <new>      // bad_alloc
+#include <string>   // pmr::string
+#include <thread>   // thread
+#include <unordered_set> // unordered_set
+#include <vector>   // vector
+
+// Checked in every build, NDEBUG or not
+#define SP_CHECK(...) \
+    do { \
+        if (!(__VA_ARGS__)) { \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #__VA_ARGS__); \
+            std::abort(); \
+        } \
+    } while (0)
+
+struct Counted {
+    static int destroyed;
+    int value = 0;
+    ~Counted() { ++destroyed; }
+};
+int Counted::destroyed = 0;
+
+// The owner releases, in one batch, a block that another thread queued to it: the merge of the
+// queue may destroy the block, which the owner's decrement must not touch afterwards.
+static void biased_release_after_queued_merge() {
+    int destroyed = Counted::destroyed;
+    sp::biased_shared_ptr<Counted> handles[3];
+    handles[0] = sp::make_biased_shared<Counted>();
+    handles[1] = handles[0];
+    sp::biased_shared_ptr<Counted> remote = handles[0];
+    std::thread([&] {
+        remote.reset();          // shared count goes negative, the block is queued to the owner
+        handles[2] = handles[1]; // remote copy restores the count
+    }).join();
+    SP_CHECK(handles[0].use_count() == 3);
+    sp::release_shared(std::begin(handles), std::end(handles)); // one dec_ref(3), then the merge
+    SP_CHECK(Counted::destroyed == destroyed + 1);
+}
+
+// Threads that exit hand their biased records to later threads.
+static void biased_records_are_reused() {
+    for (int i = 0; i < 64; ++i) {
+        sp::biased_shared_ptr<Counted> moved;
+        std::thread([&] { moved = sp::make_biased_shared<Counted>(); }).join();
+        SP_CHECK(moved.use_count() == 1);
+        moved.reset(); // last reference, held by another thread than the exited owner
+    }
+}
+
+// Deleter whose move throws, as a failed control block allocation would.
+struct ThrowingMoveDelete {
+    int* calls;
+    explicit ThrowingMoveDelete(int* c) noexcept : calls{ c } { }
+    ThrowingMoveDelete(ThrowingMoveDelete&&) { throw std::bad_alloc{}; }
+    void operator()(Counted* p) const { ++*calls; delete p; }
+};
+
+// A shared_ptr that cannot create its control block calls the deleter on the pointer it was given.
+static void shared_ptr_ctor_failure_runs_deleter() {
+    static_assert(!std::is_nothrow_constructible<sp::control_block_sbo<>, int*, std::function<void(int*)>&>::value,
+        "copying a throwing deleter into the inline buffer is not noexcept");
+    int destroyed = Counted::destroyed;
+    int calls = 0;
+    bool thrown = false;
+    try {
+        sp::shared_ptr<Counted> p{ new Counted, ThrowingMoveDelete{ &calls } };
+    } catch (const std::bad_alloc&) {
+        thrown = true;
+    }
+    SP_CHECK(thrown && calls == 1 && Counted::destroyed == destroyed + 1);
+}
+
+// Allocator whose allocate always throws.
+template<typename T>
+struct ThrowingAllocator {
+    using value_type = T;
+    ThrowingAllocator() = default;
+    template<typename U>
+    ThrowingAllocator(const ThrowingAllocator<U>&) noexcept { }
+    T* allocate(std::size_t) { throw std::bad_alloc{}; }
+    void deallocate(T*, std::size_t) noexcept { }
+    friend bool operator==(const ThrowingAllocator&, const ThrowingAllocator&) noexcept { return true; }
+    friend bool operator!=(const ThrowingAllocator&, const ThrowingAllocator&) noexcept { return false; }
+};
+
+struct CountingDelete {
+    int* calls;
+    void operator()(Counted* p) const { ++*calls; delete p; }
+};
+
+// With an allocator that cannot provide the control block, the deleter still runs on the pointer.
+static void allocator_ctor_failure_runs_deleter() {
+    static_assert(sizeof(sp::control_block_alloc<int, CountingDelete, std::allocator<int>>) == sizeof(sp::control_block<int, CountingDelete>),
+        "a stateless allocator takes no space in the block");
+    static_assert(sizeof(sp::control_block_inplace_alloc<long, std::allocator<long>>) == sizeof(sp::control_block_inplace<long>),
+        "a stateless allocator takes no space in the fused block");
+    int destroyed = Counted::destroyed;
+    int calls = 0;
+    int thrown = 0;
+    try {
+        sp::shared_ptr<Counted> p{ new Counted, CountingDelete{ &calls }, ThrowingAllocator<Counted>{} };
+    } catch (const std::bad_alloc&) {
+        ++thrown;
+    }
+    sp::shared_ptr<Counted> q;
+    try {
+        q.reset(new Counted, CountingDelete{ &calls }, ThrowingAllocator<Counted>{});
+    } catch (const std::bad_alloc&) {
+        ++thrown;
+    }
+    SP_CHECK(thrown == 2 && calls == 2 && Counted::destroyed == destroyed + 2 && !q);
+}
+
+// Output iterator that throws on a write after accepting `left` values, without taking the value.
+struct ThrowingOut {
+    using iterator_category = std::output_iterator_tag;
+    using value_type = void;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = void;
+
+    std::vector<sp::shared_ptr<Counted>>* out;
+    int left;
+
+    ThrowingOut& operator*() noexcept { return *this; }
+    ThrowingOut& operator++() noexcept { return *this; }
+    ThrowingOut& operator=(sp::shared_ptr<Counted>&& p) {
+        if (left-- == 0)
+            throw std::bad_alloc{};
+        out->push_back(std::move(p));
+        return *this;
+    }
+    ThrowingOut& operator=(const sp::shared_ptr<Counted>& p) { return *this = sp::shared_ptr<Counted>{ p }; }
+};
+
+// copy_shared and fill_shared drop exactly the references not handed out when the output throws.
+static void batched_copies_survive_throwing_output() {
+    int destroyed = Counted::destroyed;
+    std::vector<sp::shared_ptr<Counted>> sources(4, sp::make_shared<Counted>());
+    std::vector<sp::shared_ptr<Counted>> written;
+    bool thrown = false;
+    try {
+        sp::copy_shared(sources.begin(), sources.end(), ThrowingOut{ &written, 2 });
+    } catch (const std::bad_alloc&) {
+        thrown = true;
+    }
+    SP_CHECK(thrown && written.size() == 2 && sources[0].use_count() == 6);
+    thrown = false;
+    try {
+        sp::fill_shared(sources[0], 5, ThrowingOut{ &written, 1 });
+    } catch (const std::bad_alloc&) {
+        thrown = true;
+    }
+    SP_CHECK(thrown && written.size() == 3 && sources[0].use_count() == 7);
+    written.clear();
+    sources.clear();
+    SP_CHECK(Counted::destroyed == destroyed + 1);
+}
+
+// Destroys its object through deferred_delete when the thread exits.
+struct RetireAtExit {
+    Counted* p = nullptr;
+    ~RetireAtExit() { sp::deferred_delete<Counted>{}(p); }
+};
+
+// A thread_local destroyed after the thread's deferred batch still has its object reclaimed.
+static void deferred_retire_after_batch_destroyed() {
+    int destroyed = Counted::destroyed;
+    std::thread([] {
+        static thread_local RetireAtExit late; // constructed before the batch, destroyed after it
+        late.p = new Counted;
+        sp::deferred_delete<Counted>{}(new Counted);
+    }).join();
+    sp::deferred_reclaimer::drain();
+    SP_CHECK(Counted::destroyed == destroyed + 2);
+}
+
+// Values loaded from an atomic_shared_ptr share the stored object's control block.
+static void atomic_shared_ptr_loads_share_ownership() {
+    int destroyed = Counted::destroyed;
+    auto original = sp::make_shared<Counted>();
+    sp::weak_ptr<Counted> weak = original;
+    {
+        sp::atomic_shared_ptr<Counted> a{ original };
+        SP_CHECK(original.use_count() == 2);
+        auto loaded = a.load();
+        SP_CHECK(loaded.use_count() == 3 && loaded.owner_equal(original));
+        SP_CHECK(!loaded.owner_before(original) && !original.owner_before(loaded));
+        auto replacement = sp::make_shared<Counted>();
+        SP_CHECK(a.compare_exchange_strong(original, replacement)); // a copy of the stored value is equivalent
+        SP_CHECK(a.exchange(nullptr) == replacement);
+        SP_CHECK(replacement.use_count() == 1);
+        SP_CHECK(!a.compare_exchange_weak(original, replacement) && !original);
+        original = loaded;
+    }
+    original.reset();
+    SP_CHECK(weak.use_count() == 0 && weak.expired());
+    SP_CHECK(Counted::destroyed == destroyed + 2);
+}
+
+// Pooled objects are destroyed on release and their storage serves the next object of the thread.
+static void object_pool_recycles_storage() {
+    using pool = sp::object_pool<Counted>;
+    int destroyed = Counted::destroyed;
+    pool::reset_stats();
+    Counted* first = pool::make_unique().get();
+    SP_CHECK(Counted::destroyed == destroyed + 1);
+    SP_CHECK(pool::make_unique().get() == first);
+    {
+        auto shared = pool::make_shared();
+        auto copy = shared;
+        SP_CHECK(copy.use_count() == 2 && pool::stats().live == 1);
+    }
+    pool::make_shared();
+    SP_CHECK(Counted::destroyed == destroyed + 4);
+    sp::object_pool_stats stats = pool::stats();
+    SP_CHECK(stats.acquires == 4 && stats.hits == 2 && stats.live == 0);
+}
+
+// write() clones a shared object and leaves the other copies as they were.
+static void cow_ptr_detaches_on_write() {
+    auto a = sp::make_cow<Counted>();
+    auto b = a;
+    SP_CHECK(a.get() == b.get() && a.use_count() == 2);
+    b.write().value = 5;
+    SP_CHECK(a.get() != b.get() && a->value == 0 && b->value == 5 && a.unique() && b.unique());
+    const Counted* detached = b.get();
+    b.write().value = 6; // unique, written in place
+    SP_CHECK(b.get() == detached && b->value == 6);
+}
+
+// Both counts of a compact_shared_ptr share one word without disturbing each other.
+static void compact_counts_are_independent() {
+    static_assert(sizeof(sp::compact_shared_ptr<Counted>) == sizeof(void*), "compact_shared_ptr is one pointer");
+    sp::compact_header h;
+    h.inc_wref();
+    h.inc_ref();
+    SP_CHECK(h.use_count() == 2 && h.weak_use_count() == 1);
+    SP_CHECK(h.dec_ref() == 0 && h.dec_ref() == 1 && h.expired() && !h.inc_ref_nz());
+    SP_CHECK(!h.dec_wref() && h.dec_wref()); // the +1 held for the use count, then the compact_weak_ptr
+
+    int destroyed = Counted::destroyed;
+    auto p = sp::make_compact_shared<Counted>();
+    sp::compact_weak_ptr<Counted> w = p;
+    auto q = p;
+    SP_CHECK(p.use_count() == 2 && w.use_count() == 2 && w.lock() == p);
+    q.reset();
+    p.reset();
+    SP_CHECK(Counted::destroyed == destroyed + 1 && w.expired() && !w.lock());
+}
+
+// Memory resource that checks every deallocation against its outstanding allocations.
+struct TrackingResource : std::pmr::memory_resource {
+    struct block { void* p; std::size_t n, align; };
+    std::vector<block> live;
+
+    ~TrackingResource() override {
+        for (const block& b : live)
+            std::pmr::new_delete_resource()->deallocate(b.p, b.n, b.align);
+    }
+    void* do_allocate(std::size_t n, std::size_t align) override {
+        void* p = std::pmr::new_delete_resource()->allocate(n, align);
+        live.push_back({ p, n, align });
+        return p;
+    }
+    void do_deallocate(void* p, std::size_t n, std::size_t align) override {
+        auto it = std::find_if(live.begin(), live.end(), [p](const block& b) { return b.p == p; });
+        SP_CHECK(it != live.end() && it->n == n && it->align == align);
+        live.erase(it);
+        std::pmr::new_delete_resource()->deallocate(p, n, align);
+    }
+    bool do_is_equal(const std::pmr::memory_resource& r) const noexcept override { return this == &r; }
+};
+
+struct PmrA { virtual ~PmrA() = default; long a = 1; };
+struct PmrB { virtual ~PmrB() = default; long b = 2; };
+struct PmrD : PmrA, PmrB { long d = 3; };
+struct PmrThrows { PmrThrows() { throw std::bad_alloc{}; } };
+
+// pmr factories allocate from the resource, hand it to pmr containers and give back what they allocated.
+static void pmr_factories_use_the_resource() {
+    TrackingResource r;
+    {
+        auto v = sp::pmr::make_shared<std::pmr::vector<int>>(&r, 3, 7);
+        SP_CHECK(v->size() == 3 && (*v)[2] == 7 && v->get_allocator().resource() == &r);
+        auto str = sp::pmr::make_shared<std::pmr::string>(sp::pmr::bulk_release, &r, "a string too long for the small buffer");
+        SP_CHECK(str->get_allocator().resource() == &r);
+        sp::pmr::unique_ptr<PmrB> b = sp::pmr::make_unique<PmrD>(&r);
+        SP_CHECK(b->b == 2 && static_cast<void*>(b.get()) != r.live.back().p);
+        bool thrown = false;
+        try {
+            sp::pmr::make_unique<PmrThrows>(&r);
+        } catch (const std::bad_alloc&) {
+            thrown = true;
+        }
+        SP_CHECK(thrown && r.live.size() == 5); // the failed object's storage went back
+    }
+    SP_CHECK(r.live.size() == 1); // the bulk_release control block, left for the resource
+    int destroyed = Counted::destroyed;
+    sp::pmr::make_unique<Counted>(sp::pmr::bulk_release, &r).reset();
+    SP_CHECK(Counted::destroyed == destroyed + 1 && r.live.size() == 2); // destroyed, storage kept
+}
+
+// Filling an arena with small blocks stops at its capacity, headers included.
+static void arena_fills_to_capacity() {
+    alignas(sp::shared_arena::max_alignment) static unsigned char region[4096];
+    sp::shared_arena* a = sp::shared_arena::create(region, sizeof(region));
+    SP_CHECK(sp::shared_arena::attach(region) == a);
+    for (;;) {
+        try {
+            unsigned char* p = static_cast<unsigned char*>(a->allocate(16));
+            SP_CHECK(p + 16 <= region + sizeof(region));
+        } catch (const std::bad_alloc&) {
+            break;
+        }
+    }
+    SP_CHECK(a->used() <= a->capacity());
+    bool rejected = false;
+    try {
+        sp::shared_arena::create(region + 1, sizeof(region) - 1);
+    } catch (const std::bad_alloc&) {
+        rejected = true;
+    }
+    SP_CHECK(rejected);
+}
+
+struct LocalSelf : sp::enable_local_shared_from_this<LocalSelf> { };
+
+// local_shared_ptr and local_weak_ptr count on plain integers with the semantics of shared_ptr.
+static void local_shared_ptr_counts_like_shared_ptr() {
+    static_assert(std::is_same<sp::local_shared_ptr<Counted>::element_type, Counted>::value, "local_shared_ptr is a shared_ptr");
+    int destroyed = Counted::destroyed;
+    auto p = sp::make_local_shared<Counted>();
+    sp::local_weak_ptr<Counted> w = p;
+    {
+        auto q = p;
+        SP_CHECK(p.use_count() == 2 && w.use_count() == 2 && w.lock() == p);
+    }
+    SP_CHECK(p.unique() && !w.expired());
+    p.reset();
+    SP_CHECK(Counted::destroyed == destroyed + 1 && w.expired() && !w.lock());
+
+    auto self = sp::make_local_shared<LocalSelf>();
+    SP_CHECK(self->shared_from_this() == self);
+    SP_CHECK(self.use_count() == 1 && self->weak_from_this().use_count() == 1);
+}
+
+struct Node : sp::intrusive_ref_counter<Node> {
+    static int destroyed;
+    ~Node() { ++destroyed; }
+};
+int Node::destroyed = 0;
+
+// intrusive_ptr counts in the object: copies share it, detach and adopt hand a reference over untouched.
+static void intrusive_ptr_counts_in_the_object() {
+    static_assert(sizeof(sp::intrusive_ptr<Node>) == sizeof(Node*), "intrusive_ptr is one pointer");
+    int destroyed = Node::destroyed;
+    sp::intrusive_ptr<Node> p{ new Node };
+    SP_CHECK(p->use_count() == 1);
+    {
+        sp::intrusive_ptr<Node> q = p;
+        sp::intrusive_ptr<Node> r{ p.get() }; // a raw pointer takes a reference of its own
+        SP_CHECK(p->use_count() == 3 && q == r);
+    }
+    Node* raw = p.detach();
+    SP_CHECK(!p && raw->use_count() == 1);
+    p.reset(raw, false);
+    auto moved = sp::static_pointer_cast<Node>(std::move(p));
+    SP_CHECK(!p && moved->use_count() == 1 && Node::destroyed == destroyed);
+    moved.reset();
+    SP_CHECK(Node::destroyed == destroyed + 1);
+}
+
+// Array make_shared initializes and destroys every element, honours the alignment and rejects sizes that overflow.
+static void array_make_shared_elements() {
+    int destroyed = Counted::destroyed;
+    {
+        auto values = sp::make_shared<Counted[]>(3);
+        SP_CHECK(values[0].value == 0 && values[2].value == 0);
+        auto filled = sp::make_shared<int[4]>(7);
+        SP_CHECK(filled[0] == 7 && filled[3] == 7);
+        const int row[2] = { 1, 2 };
+        auto nested = sp::make_shared<int[][2]>(3, row);
+        SP_CHECK(nested[0][0] == 1 && nested[2][1] == 2);
+        auto aligned = sp::make_shared<char[]>(10, std::align_val_t{ 256 });
+        SP_CHECK(reinterpret_cast<std::uintptr_t>(aligned.get()) % 256 == 0 && aligned[9] == 0);
+    }
+    SP_CHECK(Counted::destroyed == destroyed + 3);
+    int thrown = 0;
+    try {
+        sp::make_shared<int[]>(static_cast<std::size_t>(-1) / sizeof(int));
+    } catch (const std::bad_array_new_length&) {
+        ++thrown;
+    }
+    try {
+        sp::make_shared<int[][2]>(static_cast<std::size_t>(-1) / 2 + 1); // elements times inner extent wraps
+    } catch (const std::bad_array_new_length&) {
+        ++thrown;
+    }
+    SP_CHECK(thrown == 2);
+}
+
+// Aligned make_unique_for_overwrite constructs every element in over-aligned storage and its deleter destroys them.
+static void make_unique_for_overwrite_aligns_arrays() {
+    int destroyed = Counted::destroyed;
+    auto p = sp::make_unique_for_overwrite<Counted[]>(5, std::align_val_t{ 128 });
+    SP_CHECK(reinterpret_cast<std::uintptr_t>(p.get()) % 128 == 0);
+    SP_CHECK(p.get_deleter().size() == 5 && p.get_deleter().alignment() == std::align_val_t{ 128 });
+    p.reset();
+    SP_CHECK(Counted::destroyed == destroyed + 5);
+    auto small = sp::make_unique_for_overwrite<long[]>(2, std::align_val_t{ 1 });
+    SP_CHECK(small.get_deleter().alignment() == std::align_val_t{ alignof(long) }); // raised to the element's
+    bool thrown = false;
+    try {
+        sp::make_unique_for_overwrite<long[]>(static_cast<std::size_t>(-1) / 2, std::align_val_t{ 64 });
+    } catch (const std::bad_array_new_length&) {
+        thrown = true;
+    }
+    SP_CHECK(thrown);
+}
+
+// make_shared_padded starts the object on a cache line after the counters and still destroys it once.
+static void padded_object_is_off_the_counter_line() {
+    using block = sp::control_block_inplace_padded<Counted>;
+    static_assert(alignof(block) == sp::cache_line_size && sizeof(block) == 2 * sp::cache_line_size,
+        "counters on the first line, the object on the next");
+    int destroyed = Counted::destroyed;
+    auto p = sp::make_shared_padded<Counted>();
+    SP_CHECK(reinterpret_cast<std::uintptr_t>(p.get()) % sp::cache_line_size == 0 && p->value == 0);
+    sp::weak_ptr<Counted> w = p;
+    auto q = p;
+    SP_CHECK(q.use_count() == 2 && w.lock() == p);
+    p.reset();
+    q.reset();
+    SP_CHECK(Counted::destroyed == destroyed + 1 && w.expired());
+}
+
+#if SP_REFCOUNT_STATS
+struct StatsProbe { };
+
+// refcount_stats counts every operation on the blocks of a type, and those made off the creating thread.
+static void refcount_stats_count_operations() {
+    const sp::refcount_stats& s = sp::refcount_stats::of<StatsProbe>();
+    sp::reset_refcount_stats();
+    auto p = sp::make_shared<StatsProbe>();
+    auto q = p;
+    sp::weak_ptr<StatsProbe> w = p;
+    SP_CHECK(w.lock() == p);
+    std::thread([&p] { auto remote = p; }).join();
+    p.reset();
+    q.reset();
+    SP_CHECK(!w.lock());
+    w.reset();
+    SP_CHECK(s.allocations == 1 && s.increments == 2 && s.decrements == 4 && s.peak_use_count == 3);
+    SP_CHECK(s.weak_increments == 1 && s.weak_decrements == 2 && s.weak_locks == 1 && s.failed_weak_locks == 1);
+    SP_CHECK(s.remote_operations == 2);
+    bool listed = false;
+    sp::for_each_refcount_stats([&](const sp::refcount_stats& e) { listed = listed || &e == &s; });
+    SP_CHECK(listed);
+}
+#endif
+
+// A version retired by hazard_cell::store survives reclaim while a guard protects it, and is released after.
+static void hazard_guard_defers_reclaim() {
+    int destroyed = Counted::destroyed;
+    {
+        sp::hazard_cell<Counted> cell{ sp::make_shared<Counted>() };
+        sp::hazard_guard<Counted> g = cell.protect();
+        const Counted* first = g.get();
+        SP_CHECK(first && g->value == 0);
+        auto next = sp::make_shared<Counted>();
+        next->value = 1;
+        cell.store(next);
+        cell.reclaim();
+        SP_CHECK(Counted::destroyed == destroyed && g.get() == first && cell.load() == next);
+        SP_CHECK(g.lock().use_count() == 2); // the retired version and the copy
+        g.reset();
+        cell.reclaim();
+        SP_CHECK(Counted::destroyed == destroyed + 1);
+        SP_CHECK(cell.exchange(nullptr) == next && !cell.protect());
+    }
+    SP_CHECK(Counted::destroyed == destroyed + 2);
+}
+
+// Deleter that counts the copies made of it.
+struct CopyCountingDelete {
+    int* copies;
+    explicit CopyCountingDelete(int* c) noexcept : copies{ c } { }
+    CopyCountingDelete(const CopyCountingDelete& d) noexcept : copies{ d.copies } { ++*copies; }
+    CopyCountingDelete(CopyCountingDelete&&) noexcept = default;
+    void operator()(Counted* p) const { delete p; }
+};
+
+// A shared_ptr built from a unique_ptr takes over its object and moves its deleter, a reference deleter stays a reference.
+static void unique_ptr_converts_to_shared_ptr() {
+    int destroyed = Counted::destroyed;
+    int copies = 0;
+    sp::unique_ptr<Counted, CopyCountingDelete> up{ new Counted, CopyCountingDelete{ &copies } };
+    Counted* raw = up.get();
+    sp::shared_ptr<Counted> p{ std::move(up) };
+    SP_CHECK(!up && p.get() == raw && p.use_count() == 1 && copies == 0);
+    p.reset();
+    SP_CHECK(Counted::destroyed == destroyed + 1);
+
+    int calls = 0;
+    CountingDelete d{ &calls };
+    sp::unique_ptr<Counted, CountingDelete&> by_ref{ new Counted, d };
+    p = std::move(by_ref);
+    SP_CHECK(!by_ref && p.use_count() == 1);
+    p.reset();
+    SP_CHECK(calls == 1);
+
+    sp::shared_ptr<Counted[]> array{ sp::make_unique<Counted[]>(3) };
+    sp::shared_ptr<Counted> empty{ sp::unique_ptr<Counted>{} };
+    SP_CHECK(array.use_count() == 1 && !empty && empty.use_count() == 0);
+    array.reset();
+    SP_CHECK(Counted::destroyed == destroyed + 5);
+}
+
+struct CastBase { virtual ~CastBase() = default; };
+struct CastDerived : CastBase { int value = 4; };
+struct CastOther : CastBase { };
+
+// Casting an rvalue shared_ptr moves its reference into the result; a failed dynamic cast leaves the source alone.
+static void rvalue_casts_move_the_reference() {
+    auto derived = sp::make_shared<CastDerived>();
+    sp::shared_ptr<CastBase> base = derived;
+    auto back = sp::static_pointer_cast<CastDerived>(std::move(base));
+    SP_CHECK(!base && back == derived && derived.use_count() == 2);
+    base = derived;
+    auto other = sp::dynamic_pointer_cast<CastOther>(std::move(base));
+    SP_CHECK(!other && base == derived && derived.use_count() == 3);
+    auto found = sp::dynamic_pointer_cast<CastDerived>(std::move(base));
+    SP_CHECK(!base && found->value == 4 && derived.use_count() == 3);
+    sp::shared_ptr<const CastDerived> constant = std::move(found);
+    auto mutable_again = sp::const_pointer_cast<CastDerived>(std::move(constant));
+    SP_CHECK(!constant && mutable_again == derived && derived.use_count() == 3);
+    auto bytes = sp::reinterpret_pointer_cast<const char>(std::move(mutable_again));
+    SP_CHECK(!mutable_again && static_cast<const void*>(bytes.get()) == derived.get() && derived.use_count() == 3);
+}
+
+struct Self : sp::enable_shared_from_this<Self> { };
+
+// Every way of taking ownership hooks up weak_this; an object nobody owns gives bad_weak_ptr or an empty weak_ptr.
+static void shared_from_this_follows_the_owner() {
+    Self unowned;
+    bool thrown = false;
+    try {
+        unowned.shared_from_this();
+    } catch (const std::exception& e) {
+        thrown = dynamic_cast<const sp::bad_weak_ptr*>(&e) && std::string{ e.what() } == "weak_ptr is expired!";
+    }
+    SP_CHECK(thrown && unowned.weak_from_this().expired());
+
+    auto made = sp::make_shared<Self>();
+    sp::shared_ptr<Self> from_raw{ new Self };
+    sp::shared_ptr<Self> from_unique{ sp::make_unique<Self>() };
+    for (const auto* p : { &made, &from_raw, &from_unique }) {
+        SP_CHECK((*p)->shared_from_this() == *p && (*p)->weak_from_this().lock() == *p);
+        SP_CHECK(p->use_count() == 1 && (*p)->weak_from_this().use_count() == 1);
+    }
+    Self copy = *made; // a copy is a new object, not owned by made
+    SP_CHECK(copy.weak_from_this().expired());
+    sp::weak_ptr<Self> w = made->weak_from_this();
+    made.reset();
+    SP_CHECK(w.expired());
+}
+
+// Owner hashing groups an object's aliases and survives expiry; pointer hashing agrees with std::hash and raw pointers.
+static void hashers_key_by_owner_or_pointer() {
+    auto p = sp::make_shared<Counted>();
+    sp::shared_ptr<int> alias{ p, &p->value };
+    sp::weak_ptr<Counted> w = p;
+    sp::owner_hash oh;
+    sp::owner_equal oe;
+    SP_CHECK(oh(alias) == oh(p) && oh(w) == oh(p) && oe(alias, p) && oe(w, alias));
+    SP_CHECK(std::hash<sp::weak_ptr<Counted>>()(w) == oh(w));
+    std::unordered_set<sp::weak_ptr<Counted>, sp::owner_hash, sp::owner_equal> observers{ w };
+    std::size_t before = oh(w);
+    p.reset();
+    alias.reset();
+    SP_CHECK(w.expired() && oh(w) == before && observers.count(w) == 1);
+
+    auto q = sp::make_shared<Counted>();
+    Counted unrelated;
+    sp::shared_ptr<Counted> alias_elsewhere{ q, &unrelated }; // same owner, another pointer
+    sp::pointer_hash ph;
+    sp::pointer_equal pe;
+    SP_CHECK(ph(q) == std::hash<sp::shared_ptr<Counted>>()(q) && ph(q) == ph(q.get()) && pe(q, q.get()));
+    SP_CHECK(!pe(alias_elsewhere, q) && oe(alias_elsewhere, q) && pe(sp::shared_ptr<Counted>{}, nullptr));
+    auto up = sp::make_unique<Counted>();
+    SP_CHECK(ph(up) == std::hash<sp::unique_ptr<Counted>>()(up) && pe(up, up.get()));
+    std::unordered_set<sp::shared_ptr<Counted>, sp::pointer_hash, sp::pointer_equal> handles{ q };
+    SP_CHECK(handles.count(q) == 1 && handles.count(sp::make_shared<Counted>()) == 0);
+}
+
+// Points into itself, so relocating it must run its move constructor.
+struct SelfRef {
+    SelfRef* self = this;
+    SelfRef() = default;
+    SelfRef(SelfRef&&) noexcept { }
+    ~SelfRef() { }
+};
+
+// uninitialized_relocate copies the bytes of smart pointers without touching their counts, other types are moved.
+static void uninitialized_relocate_keeps_counts() {
+    static_assert(sp::is_trivially_relocatable_v<sp::shared_ptr<Counted>> && sp::is_trivially_relocatable_v<sp::unique_ptr<Counted>>,
+        "smart pointers relocate as bytes");
+    static_assert(!sp::is_trivially_relocatable_v<SelfRef>, "a user-provided move is not trivially relocatable");
+    int destroyed = Counted::destroyed;
+    auto p = sp::make_shared<Counted>();
+    alignas(sp::shared_ptr<Counted>) unsigned char from[3 * sizeof(sp::shared_ptr<Counted>)];
+    alignas(sp::shared_ptr<Counted>) unsigned char to[3 * sizeof(sp::shared_ptr<Counted>)];
+    auto* src = reinterpret_cast<sp::shared_ptr<Counted>*>(from);
+    auto* dst = reinterpret_cast<sp::shared_ptr<Counted>*>(to);
+    std::uninitialized_fill_n(src, 3, p);
+    static_assert(noexcept(sp::uninitialized_relocate(src, src + 3, dst)), "shared_ptr ranges take the memcpy overload");
+    SP_CHECK(sp::uninitialized_relocate(src, src + 3, dst) == dst + 3); // src is now raw storage
+    SP_CHECK(p.use_count() == 4 && dst[2] == p);
+    std::destroy(dst, dst + 3);
+    p.reset();
+    SP_CHECK(Counted::destroyed == destroyed + 1 && p.use_count() == 0);
+
+    std::vector<SelfRef> objects(2);
+    alignas(SelfRef) unsigned char storage[2 * sizeof(SelfRef)];
+    auto* moved = reinterpret_cast<SelfRef*>(storage);
+    auto ends = sp::uninitialized_relocate_n(objects.data(), 2, moved); // the vector's elements are destroyed
+    SP_CHECK(ends.first == objects.data() + 2 && ends.second == moved + 2 && moved[0].self == &moved[0] && moved[1].self == &moved[1]);
+    std::uninitialized_default_construct_n(objects.data(), 2); // give the vector live objects back
+    std::destroy(moved, moved + 2);
+}
+
+int main() {
+    biased_release_after_queued_merge();
+    biased_records_are_reused();
+    shared_ptr_ctor_failure_runs_deleter();
+    allocator_ctor_failure_runs_deleter();
+    batched_copies_survive_throwing_output();
+    deferred_retire_after_batch_destroyed();
+    atomic_shared_ptr_loads_share_ownership();
+    arena_fills_to_capacity();
+    object_pool_recycles_storage();
+    pmr_factories_use_the_resource();
+    cow_ptr_detaches_on_write();
+    compact_counts_are_independent();
+    local_shared_ptr_counts_like_shared_ptr();
+    intrusive_ptr_counts_in_the_object();
+    array_make_shared_elements();
+    make_unique_for_overwrite_aligns_arrays();
+    padded_object_is_off_the_counter_line();
+#if SP_REFCOUNT_STATS
+    refcount_stats_count_operations();
+#endif
+    hazard_guard_defers_reclaim();
+    unique_ptr_converts_to_shared_ptr();
+    rvalue_casts_move_the_reference();
+    shared_from_this_follows_the_owner();
+    hashers_key_by_owner_or_pointer();
+    uninitialized_relocate_keeps_counts();
+    std::puts("smart_ptr_test: all checks passed");
+}